@@ -0,0 +1,177 @@
+#include "decoder.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define BENCH_PASSES (10)
+#define RENDER_PASSES (10000)
+
+static double elapsed_ms(const struct timespec* start)
+{
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) * 1000.0 + (end.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+static double now_us()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000.0 + now.tv_nsec / 1000.0;
+}
+
+static int compare_latency(const void* a, const void* b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+// every frame of the stream BENCH_PASSES times, rendered into pixels unless there are none. dirty only draws the changed tiles
+static void bench_pass(decoder_t* decoder, const char* label, uint8_t* pixels, size_t pitch, uint32_t format, int dirty)
+{
+	double* latency = malloc(sizeof(double) * decoder->frames * BENCH_PASSES);
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	size_t frames = 0, tiles = 0;
+	for (size_t pass = 0; pass < BENCH_PASSES; ++pass)
+	{
+		decoder_seek(decoder, 0);
+
+		int held;
+		for (double begin = now_us(); decoder_next_tilemap(decoder, &held); begin = now_us())
+		{
+			if (pixels && dirty)
+				decoder_render_dirty(decoder, pixels, pitch, format);
+			else if (pixels)
+				decoder_render(decoder, pixels, pitch, format);
+			latency[frames] = now_us() - begin;
+			tiles += !pixels ? 0 : dirty ? decoder->dirty_count : FRAME_TILE_COUNT;
+			++frames;
+		}
+	}
+
+	double elapsed = elapsed_ms(&start);
+	fprintf(stderr, "%-6s %lu frames in %.1f ms, %.0f frames/s (%.2f us/frame, %.1f tiles/frame)\n", label, frames, elapsed,
+		elapsed > 0 ? frames * 1000.0 / elapsed : 0.0, frames ? elapsed * 1000.0 / frames : 0.0, frames ? (double)tiles / frames : 0.0);
+
+	// per frame decode and render, the slow frames are the ones a player has to plan for
+	if (frames)
+	{
+		qsort(latency, frames, sizeof(double), compare_latency);
+		fprintf(stderr, "       latency p50 %.2f us, p90 %.2f us, p99 %.2f us, max %.2f us\n", latency[frames / 2],
+			latency[frames * 90 / 100], latency[frames * 99 / 100], latency[frames - 1]);
+	}
+
+	free(latency);
+}
+
+// what the player did before the lookup tables, a flipped copy of every tile and block and a branch per pixel
+static void render_reference(const decoder_t* decoder, uint8_t* pixels)
+{
+	const tiles_t* tiles = &(decoder->stream->tiles);
+	const tile_index_t* indices = decoder->current[decoder->planes - 1].tiles;
+
+	for (size_t y = 0; y < FRAME_HEIGHT; y += TILE_HEIGHT)
+	{
+		for (size_t x = 0; x < FRAME_WIDTH; x += TILE_WIDTH)
+		{
+			tile_index_t ti = *(indices++);
+			const tile_t tile = tiles_get(tiles, ti);
+			tile_render(&pixels[x + y * FRAME_WIDTH], tiles, &tile, ti & TILE_BITS_MASK, FRAME_WIDTH);
+		}
+	}
+}
+
+// one frame over and over, the reference against both decoder formats
+static void bench_render(decoder_t* decoder, uint8_t* pixels, uint8_t* bits)
+{
+	decoder_seek(decoder, 0);
+	decoder_next_tilemap(decoder, NULL);
+
+	for (size_t variant = 0; variant < 4; ++variant)
+	{
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		for (size_t pass = 0; pass < RENDER_PASSES; ++pass)
+		{
+			if (variant == 0)
+				render_reference(decoder, pixels);
+			else if (variant == 1)
+				decoder_render(decoder, pixels, FRAME_WIDTH, DECODER_FORMAT_8BPP);
+			else
+				decoder_render(decoder, bits, FRAME_WIDTH / 8, variant == 2 ? DECODER_FORMAT_1BPP : DECODER_FORMAT_PLANAR);
+		}
+
+		static const char* labels[] = { "reference 8bpp", "8bpp", "1bpp", "planar" };
+		double elapsed = elapsed_ms(&start);
+		fprintf(stderr, "render %-14s %.2f us/frame\n", labels[variant], elapsed * 1000.0 / RENDER_PASSES);
+	}
+}
+
+// bench [stream], decodes and renders without a display and reports timings, anim.bin by default
+int main(int argc, char* argv[])
+{
+	static uint8_t pixels[FRAME_WIDTH * FRAME_HEIGHT];
+	static uint8_t bits[FRAME_MAX_PLANES * (FRAME_WIDTH / 8) * FRAME_HEIGHT];
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	int fd = open(argc > 1 ? argv[1] : "anim.bin", O_RDONLY);
+	if (fd < 0)
+	{
+		fprintf(stderr, "Could not open stream\n");
+		return -1;
+	}
+
+	buffer_t file;
+	buffer_init(&file, 1);
+
+	uint8_t chunk[65536];
+	for (ssize_t n; (n = read(fd, chunk, sizeof(chunk))) > 0;)
+		buffer_add(&file, chunk, n);
+	close(fd);
+
+	double load = elapsed_ms(&start);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	decoder_t* decoder = decoder_open_buffer(file.data, buffer_count(&file));
+	if (!decoder)
+	{
+		fprintf(stderr, "Could not read stream\n");
+		return -1;
+	}
+
+	double open = elapsed_ms(&start);
+
+	// decompressed once more on its own, to split the open time
+	buffer_t payload, sections;
+	buffer_init(&payload, 1);
+	buffer_init(&sections, 1);
+	buffer_set(&payload, file.data + sizeof(stream_header_t), decoder->header.compressed_size);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	stream_decompress(&sections, &payload);
+	double decompress = elapsed_ms(&start);
+
+	fprintf(stderr, "%lu frames, %lu planes, %lu bytes: load %.2f ms, open %.2f ms (decompress %.2f ms to %lu bytes, dictionaries %.2f ms)\n",
+		decoder->frames, decoder->planes, buffer_count(&file), load, open, decompress, buffer_count(&sections), open > decompress ? open - decompress : 0.0);
+	buffer_release(&sections);
+
+	bench_pass(decoder, "maps", NULL, 0, 0, 0);
+	bench_pass(decoder, "8bpp", pixels, FRAME_WIDTH, DECODER_FORMAT_8BPP, 0);
+	bench_pass(decoder, "1bpp", bits, FRAME_WIDTH / 8, DECODER_FORMAT_1BPP, 0);
+	bench_pass(decoder, "planar", bits, FRAME_WIDTH / 8, DECODER_FORMAT_PLANAR, 0);
+	bench_pass(decoder, "dirty", pixels, FRAME_WIDTH, DECODER_FORMAT_8BPP, 1);
+	bench_render(decoder, pixels, bits);
+
+	decoder_close(decoder);
+	buffer_release(&file);
+	return 0;
+}
@@ -96,7 +96,9 @@ uint32_t bits_read(bits_t* bits, size_t count)
     {
         if (bcount == 0)
         {
-            bdata = *(const uint8_t*)buffer_get(&(bits->buf), bits->offset++);
+            // past the end reads zeros, offset still moves on so bits_overrun can tell
+            bdata = bits->offset < buffer_count(&(bits->buf)) ? *(const uint8_t*)buffer_get(&(bits->buf), bits->offset) : 0;
+            ++(bits->offset);
             bcount = 8;
         }
 
@@ -115,3 +117,8 @@ uint32_t bits_read(bits_t* bits, size_t count)
 
     return out;
 }
+
+int bits_overrun(const bits_t* bits)
+{
+    return bits->offset > buffer_count(&(bits->buf));
+}
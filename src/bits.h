@@ -21,3 +21,5 @@ void bits_reset(bits_t* bits);
 
 void bits_write(bits_t* bits, uint32_t data, size_t count);
 uint32_t bits_read(bits_t* bits, size_t count);
+// reads went past the end of the data
+int bits_overrun(const bits_t* bits);
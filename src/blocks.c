@@ -24,6 +24,9 @@ void blocks_init(blocks_t* blocks)
 
 	for (size_t i = 0; i < BLOCK_HASH_SIZE; ++i)
 		blocks->hash[i] = NO_BLOCK;
+
+	blocks->variants = BLOCK_VARIANTS_ALL;
+	blocks->solid = 0;
 }
 
 void blocks_release(blocks_t* blocks)
@@ -31,6 +34,24 @@ void blocks_release(blocks_t* blocks)
 	buffer_release(&(blocks->buffer));
 }
 
+// must be called on an empty dictionary, so the black block lands at BLOCK_SOLID
+void blocks_reserve_solid(blocks_t* blocks)
+{
+	block_t* temp = buffer_alloc(&(blocks->buffer), 1);
+	memset(temp->bits, 0, sizeof(temp->bits));
+
+	// hashed like any other block so near solid blocks can still be matched onto it
+	uint32_t hash = hash_block(temp) & (BLOCK_HASH_SIZE-1);
+	temp->next = blocks->hash[hash];
+	blocks->hash[hash] = BLOCK_SOLID;
+
+	temp->count = 0;
+	temp->remap = NO_BLOCK;
+	temp->incoming = 0;
+
+	blocks->solid = 1;
+}
+
 block_t build_block(const uint8_t* pixels, uint8_t threshold, int32_t pitch)
 {
 	block_t temp;
@@ -147,7 +168,7 @@ size_t block_diff(const block_t* a, const block_t* b)
 
 block_index_t blocks_match(blocks_t* blocks, const block_t* block)
 {
-	for (size_t i = 0; i < sizeof_array(block_variants); ++i)
+	for (size_t i = 0; i < blocks->variants; ++i)
 	{
 		uint32_t variant = block_variants[i];
 
@@ -181,8 +202,52 @@ block_index_t blocks_match(blocks_t* blocks, const block_t* block)
 	return NO_BLOCK;
 }
 
+// appended as is, without looking for a match
+block_index_t blocks_add(blocks_t* blocks, const block_t* block)
+{
+	block_t* out = buffer_alloc(&(blocks->buffer), 1);
+	memcpy(out->bits, block->bits, sizeof(out->bits));
+
+	uint32_t offset = buffer_offset(&(blocks->buffer), out);
+	uint32_t hash = hash_block(out) & (BLOCK_HASH_SIZE-1);
+	out->next = blocks->hash[hash];
+	blocks->hash[hash] = offset;
+
+	out->count = 0;
+	out->remap = NO_BLOCK;
+	out->incoming = 0;
+
+	return offset;
+}
+
+block_index_t blocks_find(const blocks_t* blocks, const block_t* block)
+{
+	uint32_t index = blocks->hash[hash_block(block) & (BLOCK_HASH_SIZE-1)];
+	while (index != NO_BLOCK)
+	{
+		const block_t* candidate = buffer_get(&(blocks->buffer), index);
+		if (!memcmp(candidate->bits, block->bits, sizeof(block->bits)))
+			break;
+		index = candidate->next;
+	}
+	return index;
+}
+
 block_index_t blocks_insert(blocks_t* blocks, const block_t* block)
 {
+	if (blocks->solid)
+	{
+		uint64_t bits;
+		memcpy(&bits, block->bits, sizeof(bits));
+
+		if (bits == 0 || bits == ~(uint64_t)0)
+		{
+			block_t* solid = buffer_get(&(blocks->buffer), BLOCK_SOLID);
+			solid->count++;
+			return BLOCK_SOLID | (bits ? BLOCK_INVERT : 0);
+		}
+	}
+
 	block_index_t index = blocks_match(blocks, block);
 	if (index != NO_BLOCK)
 	{
@@ -207,6 +272,39 @@ block_index_t blocks_insert(blocks_t* blocks, const block_t* block)
 	return offset;
 }
 
+// drops the blocks from count on, the hash only keeps the ones left
+void blocks_truncate(blocks_t* blocks, size_t count)
+{
+	if (count >= buffer_count(&(blocks->buffer)))
+		return;
+
+	blocks->buffer.size = count * blocks->buffer.elemsize;
+
+	for (size_t i = 0; i < BLOCK_HASH_SIZE; ++i)
+		blocks->hash[i] = NO_BLOCK;
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		block_t* curr = buffer_get(&(blocks->buffer), i);
+		uint32_t hash = hash_block(curr) & (BLOCK_HASH_SIZE-1);
+		curr->next = blocks->hash[hash];
+		blocks->hash[hash] = i;
+	}
+}
+
+// every block of other is matched or appended, remaps gets where each went and the counts add up
+void blocks_merge(blocks_t* blocks, const blocks_t* other, block_index_t* remaps)
+{
+	for (size_t i = 0, n = buffer_count(&(other->buffer)); i < n; ++i)
+	{
+		const block_t* in = buffer_get(&(other->buffer), i);
+		remaps[i] = blocks_insert(blocks, in);
+
+		block_t* out = buffer_get(&(blocks->buffer), remaps[i] & ~BLOCK_BITS_MASK);
+		out->count += in->count - 1;
+	}
+}
+
 void blocks_find_matches(blocks_t* blocks, size_t max_error)
 {
     size_t matches = 0;
@@ -216,7 +314,7 @@ void blocks_find_matches(blocks_t* blocks, size_t max_error)
         block_t* curr = buffer_get(&(blocks->buffer), i);
         uint32_t hash = hash_block(curr);
 
-        if (curr->count == 0)
+        if (curr->count == 0 || (blocks->solid && i == BLOCK_SOLID))
             continue;
 
         int max_diff = max_error;
@@ -339,10 +437,17 @@ void block_render(uint8_t* pixels, const block_t* block, uint32_t pitch)
     }
 }
 
+void block_fill(uint8_t* pixels, uint8_t value, uint32_t pitch)
+{
+    for (size_t y = 0; y < BLOCK_HEIGHT; ++y)
+        memset(&pixels[y * pitch], value, BLOCK_WIDTH);
+}
+
 void blocks_rebuild(blocks_t* blocks, block_index_t* remaps)
 {
     buffer_t old = blocks->buffer;
     buffer_init(&(blocks->buffer), old.elemsize);
+    buffer_reserve(&(blocks->buffer), buffer_count(&old));
 
     for (size_t i = 0; i < BLOCK_HASH_SIZE; ++i)
     {
@@ -352,7 +457,7 @@ void blocks_rebuild(blocks_t* blocks, block_index_t* remaps)
     for (size_t i = 0, n = buffer_count(&old); i < n; ++i)
     {
         block_t* old_block = (block_t*)buffer_get(&old, i);
-        if (old_block->count == 0)
+        if (old_block->count == 0 && !(blocks->solid && i == BLOCK_SOLID))
         {
             remaps[i] = NO_BLOCK;
             continue;
@@ -382,6 +487,10 @@ void blocks_rebuild(blocks_t* blocks, block_index_t* remaps)
         if (old_block->count > 0)
             continue;
 
+        // no longer referenced at all
+        if (old_block->remap == NO_BLOCK)
+            continue;
+
         uint32_t index = old_block->remap & ~BLOCK_BITS_MASK;
         uint32_t flags = old_block->remap & BLOCK_BITS_MASK;
 
@@ -392,16 +501,49 @@ void blocks_rebuild(blocks_t* blocks, block_index_t* remaps)
     buffer_release(&old);
 }
 
+// order[i] is the old index of the block that ends up at index i
+void blocks_reorder(blocks_t* blocks, const uint32_t* order, block_index_t* remaps)
+{
+    buffer_t old = blocks->buffer;
+    buffer_init(&(blocks->buffer), old.elemsize);
+    buffer_reserve(&(blocks->buffer), buffer_count(&old));
+
+    for (size_t i = 0; i < BLOCK_HASH_SIZE; ++i)
+    {
+        blocks->hash[i] = NO_BLOCK;
+    }
+
+    for (size_t i = 0, n = buffer_count(&old); i < n; ++i)
+    {
+        const block_t* old_block = (const block_t*)buffer_get(&old, order[i]);
+        block_t* new_block = (block_t*)buffer_alloc(&(blocks->buffer), 1);
+
+        *new_block = *old_block;
+
+        uint32_t hash = hash_block(new_block) & (BLOCK_HASH_SIZE-1);
+        new_block->next = blocks->hash[hash];
+        blocks->hash[hash] = i;
+
+        remaps[order[i]] = i;
+    }
+
+    buffer_release(&old);
+}
+
 #define sizeof_member(type, member) sizeof(((type *)0)->member)
 static const size_t BLOCK_DATA_SIZE = sizeof_member(block_t, bits);
 
-size_t blocks_load(const buffer_t* in, size_t offset, size_t count, blocks_t* blocks)
+long blocks_load(const buffer_t* in, size_t offset, size_t count, blocks_t* blocks)
 {
+    if (offset > buffer_count(in) || (buffer_count(in) - offset) / BLOCK_DATA_SIZE < count)
+        return -1;
+
     for (size_t i = 0; i < BLOCK_HASH_SIZE; ++i)
     {
         blocks->hash[i] = NO_BLOCK;
     }
 
+    buffer_reserve(&(blocks->buffer), count);
     for (size_t i = 0, n = count; i < n; ++i)
     {
         block_t* block = buffer_alloc(&(blocks->buffer), 1);
@@ -426,6 +568,7 @@ size_t blocks_load(const buffer_t* in, size_t offset, size_t count, blocks_t* bl
 
 void blocks_save(buffer_t* out, const blocks_t* blocks)
 {
+	buffer_reserve(out, buffer_count(&(blocks->buffer)) * BLOCK_DATA_SIZE);
 	for (size_t i = 0, n = buffer_count(&(blocks->buffer)); i < n; ++i)
 	{
 		const block_t* block = buffer_get(&(blocks->buffer), i);
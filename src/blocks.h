@@ -14,6 +14,13 @@ typedef uint32_t block_index_t;
 #define BLOCK_INVERT (0x20000000)
 #define BLOCK_BITS_MASK (BLOCK_FLIP_X|BLOCK_FLIP_Y|BLOCK_INVERT)
 
+// variants are tried blitter friendly (no flip x) first
+#define BLOCK_VARIANTS_BLITTER (4)
+#define BLOCK_VARIANTS_ALL (8)
+
+// with solid set block 0 is reserved all black, BLOCK_SOLID|BLOCK_INVERT is all white
+#define BLOCK_SOLID (0)
+
 typedef struct block_t
 {
 	uint8_t bits[(BLOCK_WIDTH / 8) * BLOCK_HEIGHT];
@@ -28,23 +35,35 @@ typedef struct blocks_t
 {
 	buffer_t buffer;
 	uint32_t hash[BLOCK_HASH_SIZE];
+
+	size_t variants; // number of variants matching may use, BLOCK_VARIANTS_*
+	int solid; // BLOCK_SOLID is reserved and pinned at index 0
 } blocks_t;
 
 void blocks_init(blocks_t* blocks);
 void blocks_release(blocks_t* blocks);
+void blocks_reserve_solid(blocks_t* blocks);
 
 block_t build_block(const uint8_t* pixels, uint8_t threshold, int32_t pitch);
 uint32_t hash_block(const block_t* block);
 
 block_index_t blocks_insert(blocks_t* blocks, const block_t* block);
+block_index_t blocks_add(blocks_t* blocks, const block_t* block);
+// the entry with exactly the bits of block, no variants, NO_BLOCK if there is none
+block_index_t blocks_find(const blocks_t* blocks, const block_t* block);
+void blocks_merge(blocks_t* blocks, const blocks_t* other, block_index_t* remaps);
+void blocks_truncate(blocks_t* blocks, size_t count);
 block_t blocks_get(const blocks_t* blocks, block_index_t index);
 size_t block_match(const block_t* a, const block_t* b);
+size_t block_diff(const block_t* a, const block_t* b);
 
 void block_render(uint8_t* pixels, const block_t* block, uint32_t pitch);
+void block_fill(uint8_t* pixels, uint8_t value, uint32_t pitch);
 
 void blocks_find_matches(blocks_t* blocks, size_t max_error);
 void blocks_reduce(blocks_t* blocks);
 void blocks_rebuild(blocks_t* blocks, uint32_t* remap);
+void blocks_reorder(blocks_t* blocks, const uint32_t* order, block_index_t* remaps);
 
-size_t blocks_load(const buffer_t* in, size_t offset, size_t count, blocks_t* blocks);
+long blocks_load(const buffer_t* in, size_t offset, size_t count, blocks_t* blocks);
 void blocks_save(buffer_t* out, const blocks_t* blocks);
@@ -34,6 +34,33 @@ void buffer_reset(buffer_t* buffer)
 	buffer->size = 0;
 }
 
+/*
+    grows in place where realloc can, large blocks are mapped pages that glibc moves with mremap rather
+    than copying. data from buffer_set belongs to the caller, it is copied out and left alone
+*/
+static void buffer_grow(buffer_t* buffer, size_t capacity)
+{
+	uint8_t* data;
+	if (buffer->capacity == 0)
+	{
+		data = malloc(capacity);
+		if (buffer->size)
+			memcpy(data, buffer->data, buffer->size);
+	}
+	else
+		data = realloc(buffer->data, capacity);
+
+	buffer->capacity = capacity;
+	buffer->data = data;
+}
+
+void buffer_reserve(buffer_t* buffer, size_t elements)
+{
+	size_t size = buffer->size + (elements * buffer->elemsize);
+	if (size > buffer->capacity)
+		buffer_grow(buffer, size);
+}
+
 void* buffer_alloc(buffer_t* buffer, size_t elements)
 {
 	size_t newSize = buffer->size + (elements * buffer->elemsize);
@@ -42,14 +69,7 @@ void* buffer_alloc(buffer_t* buffer, size_t elements)
 		size_t newCapacity = buffer->capacity > 0 ? (buffer->capacity * 15)/10 : newSize * 2;
 		newCapacity = newCapacity < newSize ? newSize : newCapacity;
 
-		uint8_t* newData = malloc(newCapacity);
-		memcpy(newData, buffer->data, buffer->size);
-
-		if (buffer->data)
-			free(buffer->data);
-
-		buffer->capacity = newCapacity;
-		buffer->data = newData;
+		buffer_grow(buffer, newCapacity);
 	}
 
 	uint8_t* data = buffer->data + buffer->size;
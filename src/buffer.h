@@ -17,6 +17,8 @@ void buffer_set(buffer_t* buffer, const uint8_t* data, size_t length);
 void buffer_release(buffer_t* buffer);
 void buffer_reset(buffer_t* buffer);
 
+// room for elements more without adding them, a known count then grows the buffer once
+void buffer_reserve(buffer_t* buffer, size_t elements);
 void* buffer_alloc(buffer_t* buffer, size_t elements);
 void* buffer_add(buffer_t* buffer, const void* data, size_t size);
 void* buffer_get(const buffer_t* buffer, size_t index);
@@ -0,0 +1,304 @@
+#include "cache.h"
+
+#include <string.h>
+#include <stdio.h>
+
+#define NEVER (0xffffffff)
+
+// the first map after the current one showing a tile made of block
+static uint32_t block_needed(const uint32_t* user_first, const uint32_t* users, const uint32_t* tile_next, size_t block)
+{
+	uint32_t next = NEVER;
+	for (size_t u = user_first[block]; u < user_first[block + 1]; ++u)
+		next = tile_next[users[u]] < next ? tile_next[users[u]] : next;
+	return next;
+}
+
+/*
+    a free slot, or the one holding whatever is needed again furthest ahead. entries locked for the current
+    frame and the first pinned slots are never taken
+*/
+static uint32_t pick_slot(const uint32_t* owners, size_t slots, size_t pinned, const uint32_t* locks, const uint32_t* next_use, size_t frame)
+{
+	uint32_t best = NO_SLOT, best_next = 0;
+	for (size_t s = pinned; s < slots; ++s)
+	{
+		if (owners[s] == NO_SLOT)
+			return s;
+		if (locks[owners[s]] == frame + 1)
+			continue;
+
+		uint32_t next = next_use[owners[s]];
+		if (best == NO_SLOT || next > best_next)
+		{
+			best = s;
+			best_next = next;
+		}
+	}
+	return best;
+}
+
+void cache_init(cache_t* cache, size_t tile_slots, size_t block_slots)
+{
+	cache->tile_slots = tile_slots;
+	cache->block_slots = block_slots;
+
+	frames_init(&(cache->maps));
+	buffer_init(&(cache->blocks), sizeof(cache_block_upload_t));
+	buffer_init(&(cache->tiles), sizeof(cache_tile_upload_t));
+	buffer_init(&(cache->ranges), sizeof(cache_range_t));
+}
+
+void cache_release(cache_t* cache)
+{
+	buffer_release(&(cache->ranges));
+	buffer_release(&(cache->tiles));
+	buffer_release(&(cache->blocks));
+	frames_release(&(cache->maps));
+}
+
+const cache_range_t* cache_range(const cache_t* cache, size_t map)
+{
+	return buffer_get(&(cache->ranges), map);
+}
+
+/*
+    what pick_slot needs is when each entry is shown next. a backward pass leaves that per map position, so
+    tile_next only has to be moved on for the tiles of the map just planned. a block is next needed with the
+    first of the tiles using it, those are found through users
+*/
+int cache_schedule(cache_t* cache, const frames_t* frames, const tiles_t* tiles)
+{
+	size_t maps = buffer_count(&(frames->buffer));
+	size_t tile_count = buffer_count(&(tiles->buffer));
+	size_t block_count = buffer_count(&(tiles->blocks.buffer));
+
+	uint32_t* next_shown = malloc(sizeof(uint32_t) * maps * FRAME_TILE_COUNT);
+	uint32_t* tile_next = malloc(sizeof(uint32_t) * tile_count);
+	uint32_t* block_next = malloc(sizeof(uint32_t) * block_count);
+	uint32_t* tile_locks = calloc(tile_count, sizeof(uint32_t));
+	uint32_t* block_locks = calloc(block_count, sizeof(uint32_t));
+
+	memset(tile_next, 0xff, sizeof(uint32_t) * tile_count);
+	for (size_t t = maps; t-- > 0;)
+	{
+		const frame_t* curr = buffer_get(&(frames->buffer), t);
+		for (size_t p = 0; p < FRAME_TILE_COUNT; ++p)
+			next_shown[t * FRAME_TILE_COUNT + p] = tile_next[curr->tiles[p] & ~TILE_BITS_MASK];
+		for (size_t p = 0; p < FRAME_TILE_COUNT; ++p)
+			tile_next[curr->tiles[p] & ~TILE_BITS_MASK] = t;
+	}
+
+	// the tiles made of each block
+	uint32_t* user_first = calloc(block_count + 1, sizeof(uint32_t));
+	uint32_t* users = malloc(sizeof(uint32_t) * tile_count * TILE_INDEX_COUNT);
+
+	for (size_t i = 0; i < tile_count; ++i)
+	{
+		const tile_t* tile = buffer_get(&(tiles->buffer), i);
+		for (size_t k = 0; k < TILE_INDEX_COUNT; ++k)
+			user_first[(tile->indices[k] & ~BLOCK_BITS_MASK) + 1]++;
+	}
+	for (size_t i = 0; i < block_count; ++i)
+		user_first[i + 1] += user_first[i];
+
+	// block_next is the fill cursor first
+	memcpy(block_next, user_first, sizeof(uint32_t) * block_count);
+	for (size_t i = 0; i < tile_count; ++i)
+	{
+		const tile_t* tile = buffer_get(&(tiles->buffer), i);
+		for (size_t k = 0; k < TILE_INDEX_COUNT; ++k)
+			users[block_next[tile->indices[k] & ~BLOCK_BITS_MASK]++] = i;
+	}
+
+	for (size_t i = 0; i < block_count; ++i)
+		block_next[i] = block_needed(user_first, users, tile_next, i);
+
+	uint32_t* tile_owners = malloc(sizeof(uint32_t) * cache->tile_slots);
+	uint32_t* block_owners = malloc(sizeof(uint32_t) * cache->block_slots);
+	uint32_t* tile_slot_of = malloc(sizeof(uint32_t) * tile_count);
+	uint32_t* block_slot_of = malloc(sizeof(uint32_t) * block_count);
+
+	memset(tile_owners, 0xff, sizeof(uint32_t) * cache->tile_slots);
+	memset(block_owners, 0xff, sizeof(uint32_t) * cache->block_slots);
+	memset(tile_slot_of, 0xff, sizeof(uint32_t) * tile_count);
+	memset(block_slot_of, 0xff, sizeof(uint32_t) * block_count);
+
+	// the solid tile and block never leave slot 0, the decoder has them without an upload
+	size_t pinned = 0;
+	if (tiles->blocks.solid && cache->tile_slots && cache->block_slots)
+	{
+		tile_owners[0] = TILE_SOLID;
+		tile_slot_of[TILE_SOLID] = 0;
+		block_owners[0] = BLOCK_SOLID;
+		block_slot_of[BLOCK_SOLID] = 0;
+		pinned = 1;
+	}
+
+	buffer_reset(&(cache->maps.buffer));
+	buffer_reset(&(cache->maps.held));
+	buffer_reset(&(cache->blocks));
+	buffer_reset(&(cache->tiles));
+	buffer_reset(&(cache->ranges));
+	cache->maps.planes = frames->planes;
+
+	int result = 0;
+	size_t evicted = 0, dropped = 0;
+
+	for (size_t t = 0; t < maps && !result; ++t)
+	{
+		/*
+		    the decoder overwrites slots in place, so what the maps of a frame show stays until the whole
+		    frame is decoded and drawn. the uploads for one plane must not take the slots of another
+		*/
+		size_t frame = t / frames->planes;
+		for (size_t m = t; m < maps && m < (frame + 1) * frames->planes && t % frames->planes == 0; ++m)
+		{
+			const frame_t* map = buffer_get(&(frames->buffer), m);
+			for (size_t p = 0; p < FRAME_TILE_COUNT; ++p)
+			{
+				uint32_t ti = map->tiles[p] & ~TILE_BITS_MASK;
+				const tile_t* tile = buffer_get(&(tiles->buffer), ti);
+
+				tile_locks[ti] = frame + 1;
+				for (size_t k = 0; k < TILE_INDEX_COUNT; ++k)
+					block_locks[tile->indices[k] & ~BLOCK_BITS_MASK] = frame + 1;
+			}
+		}
+
+		const frame_t* curr = buffer_get(&(frames->buffer), t);
+
+		cache_range_t range;
+		range.first_block = buffer_count(&(cache->blocks));
+		range.first_tile = buffer_count(&(cache->tiles));
+
+		for (size_t p = 0; p < FRAME_TILE_COUNT && !result; ++p)
+		{
+			uint32_t ti = curr->tiles[p] & ~TILE_BITS_MASK;
+			if (tile_slot_of[ti] != NO_SLOT)
+				continue;
+
+			const tile_t* tile = buffer_get(&(tiles->buffer), ti);
+			for (size_t k = 0; k < TILE_INDEX_COUNT; ++k)
+			{
+				uint32_t bi = tile->indices[k] & ~BLOCK_BITS_MASK;
+				if (block_slot_of[bi] != NO_SLOT)
+					continue;
+
+				uint32_t slot = pick_slot(block_owners, cache->block_slots, pinned, block_locks, block_next, frame);
+				if (slot == NO_SLOT)
+				{
+					result = -1;
+					break;
+				}
+
+				// tiles that still use the block go with it, none of them are on this frame
+				if (block_owners[slot] != NO_SLOT)
+				{
+					uint32_t old = block_owners[slot];
+					block_slot_of[old] = NO_SLOT;
+					++evicted;
+
+					for (size_t s = pinned; s < cache->tile_slots; ++s)
+					{
+						if (tile_owners[s] == NO_SLOT)
+							continue;
+
+						const tile_t* user = buffer_get(&(tiles->buffer), tile_owners[s]);
+						for (size_t l = 0; l < TILE_INDEX_COUNT; ++l)
+						{
+							if ((user->indices[l] & ~BLOCK_BITS_MASK) == old)
+							{
+								tile_slot_of[tile_owners[s]] = NO_SLOT;
+								tile_owners[s] = NO_SLOT;
+								++dropped;
+								break;
+							}
+						}
+					}
+				}
+
+				block_owners[slot] = bi;
+				block_slot_of[bi] = slot;
+
+				cache_block_upload_t* upload = buffer_alloc(&(cache->blocks), 1);
+				upload->slot = slot;
+				upload->index = bi;
+			}
+
+			uint32_t slot = result ? NO_SLOT : pick_slot(tile_owners, cache->tile_slots, pinned, tile_locks, tile_next, frame);
+			if (slot == NO_SLOT)
+			{
+				result = -1;
+				break;
+			}
+
+			if (tile_owners[slot] != NO_SLOT)
+			{
+				tile_slot_of[tile_owners[slot]] = NO_SLOT;
+				++evicted;
+			}
+			tile_owners[slot] = ti;
+			tile_slot_of[ti] = slot;
+
+			cache_tile_upload_t* upload = buffer_alloc(&(cache->tiles), 1);
+			upload->slot = slot;
+			for (size_t k = 0; k < TILE_INDEX_COUNT; ++k)
+			{
+				block_index_t index = tile->indices[k];
+				upload->indices[k] = block_slot_of[index & ~BLOCK_BITS_MASK] | (index & BLOCK_BITS_MASK);
+			}
+		}
+
+		if (result)
+		{
+			fprintf(stderr, "cache: map %lu needs more than %lu tile / %lu block slots\n", t, cache->tile_slots, cache->block_slots);
+			break;
+		}
+
+		range.blocks = buffer_count(&(cache->blocks)) - range.first_block;
+		range.tiles = buffer_count(&(cache->tiles)) - range.first_tile;
+		*(cache_range_t*)buffer_alloc(&(cache->ranges), 1) = range;
+
+		frame_t map;
+		for (size_t p = 0; p < FRAME_TILE_COUNT; ++p)
+			map.tiles[p] = tile_slot_of[curr->tiles[p] & ~TILE_BITS_MASK] | (curr->tiles[p] & TILE_BITS_MASK);
+		frames_add(&(cache->maps), &map);
+
+		// on to the next time the tiles of this map are shown, and their blocks needed
+		for (size_t p = 0; p < FRAME_TILE_COUNT; ++p)
+			tile_next[curr->tiles[p] & ~TILE_BITS_MASK] = next_shown[t * FRAME_TILE_COUNT + p];
+		for (size_t p = 0; p < FRAME_TILE_COUNT; ++p)
+		{
+			const tile_t* tile = buffer_get(&(tiles->buffer), curr->tiles[p] & ~TILE_BITS_MASK);
+			for (size_t k = 0; k < TILE_INDEX_COUNT; ++k)
+			{
+				// every block of the map is needed at t until it has been moved on
+				uint32_t bi = tile->indices[k] & ~BLOCK_BITS_MASK;
+				if (block_next[bi] == t)
+					block_next[bi] = block_needed(user_first, users, tile_next, bi);
+			}
+		}
+	}
+
+	if (!result)
+	{
+		fprintf(stderr, "cache: %lu tile / %lu block slots, %lu tile and %lu block uploads for %lu tiles and %lu blocks, %lu evictions, %lu tiles dropped with their blocks\n",
+			cache->tile_slots, cache->block_slots, buffer_count(&(cache->tiles)), buffer_count(&(cache->blocks)), tile_count, block_count, evicted, dropped);
+	}
+
+	free(block_slot_of);
+	free(tile_slot_of);
+	free(block_owners);
+	free(tile_owners);
+
+	free(users);
+	free(user_first);
+	free(block_locks);
+	free(tile_locks);
+	free(block_next);
+	free(tile_next);
+	free(next_shown);
+
+	return result;
+}
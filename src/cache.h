@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "frames.h"
+#include "tiles.h"
+
+#define NO_SLOT (0xffffffff)
+
+// block into a decoder block slot
+typedef struct cache_block_upload_t
+{
+	uint32_t slot;
+	block_index_t index;
+} cache_block_upload_t;
+
+// tile into a decoder tile slot, the blocks are block slots with the BLOCK_* flags
+typedef struct cache_tile_upload_t
+{
+	uint32_t slot;
+	block_index_t indices[TILE_INDEX_COUNT];
+} cache_tile_upload_t;
+
+// uploads that go ahead of a map
+typedef struct cache_range_t
+{
+	uint32_t first_block;
+	uint32_t blocks;
+	uint32_t first_tile;
+	uint32_t tiles;
+} cache_range_t;
+
+/*
+    STREAM_FLAG_TILE_CACHE: the decoder holds tile_slots tiles and block_slots blocks and uploads overwrite them in
+    place. the maps reference tile slots. a tile slot is only good while its blocks stay in their slots, evicting a
+    block drops the tiles using it. nothing the maps of a frame show is evicted before the frame is done
+*/
+typedef struct cache_t
+{
+	size_t tile_slots;
+	size_t block_slots;
+
+	frames_t maps; // the frame maps with tile slots in place of tile indices
+	buffer_t blocks; // cache_block_upload_t
+	buffer_t tiles; // cache_tile_upload_t
+	buffer_t ranges; // cache_range_t per map
+} cache_t;
+
+void cache_init(cache_t* cache, size_t tile_slots, size_t block_slots);
+void cache_release(cache_t* cache);
+
+// plan the uploads for frames, evicting whatever is needed again furthest ahead. -1 when a map needs more slots than there are
+int cache_schedule(cache_t* cache, const frames_t* frames, const tiles_t* tiles);
+const cache_range_t* cache_range(const cache_t* cache, size_t map);
@@ -0,0 +1,376 @@
+#include "codec.h"
+
+#include <string.h>
+
+#define LZ_MIN_MATCH (4)
+#define LZ_MAX_OFFSET (0xffff)
+#define LZ_HASH_BITS (12)
+
+static uint32_t lz_hash(const uint8_t* p)
+{
+	uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+	return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t* lz_write_length(uint8_t* op, const uint8_t* end, size_t length)
+{
+	for (; length >= 255; length -= 255)
+	{
+		if (op >= end)
+			return NULL;
+		*op++ = 255;
+	}
+
+	if (op >= end)
+		return NULL;
+	*op++ = length;
+
+	return op;
+}
+
+static uint8_t* lz_write_sequence(uint8_t* op, const uint8_t* end, const uint8_t* literals, size_t literal_count, size_t offset, size_t match_length)
+{
+	size_t match_code = match_length ? match_length - LZ_MIN_MATCH : 0;
+
+	if (op >= end)
+		return NULL;
+
+	uint8_t* token = op++;
+	*token = ((literal_count < 15 ? literal_count : 15) << 4) | (match_code < 15 ? match_code : 15);
+
+	if (literal_count >= 15 && !(op = lz_write_length(op, end, literal_count - 15)))
+		return NULL;
+
+	if ((size_t)(end - op) < literal_count)
+		return NULL;
+	memcpy(op, literals, literal_count);
+	op += literal_count;
+
+	if (!match_length)
+		return op;
+
+	if (end - op < 2)
+		return NULL;
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+
+	if (match_code >= 15 && !(op = lz_write_length(op, end, match_code - 15)))
+		return NULL;
+
+	return op;
+}
+
+size_t lz_compress(const uint8_t* in, size_t length, uint8_t* out, size_t maxout)
+{
+	uint32_t table[1 << LZ_HASH_BITS];
+	memset(table, 0, sizeof(table));
+
+	const uint8_t* end = out + maxout;
+	uint8_t* op = out;
+
+	size_t anchor = 0;
+	size_t i = 0;
+
+	while (i + LZ_MIN_MATCH <= length)
+	{
+		uint32_t hash = lz_hash(in + i);
+		size_t candidate = table[hash];
+		table[hash] = i + 1;
+
+		if (candidate && (i - (candidate - 1)) <= LZ_MAX_OFFSET && !memcmp(in + candidate - 1, in + i, LZ_MIN_MATCH))
+		{
+			size_t ref = candidate - 1;
+			size_t match_length = LZ_MIN_MATCH;
+			while (i + match_length < length && in[ref + match_length] == in[i + match_length])
+				++match_length;
+
+			if (!(op = lz_write_sequence(op, end, in + anchor, i - anchor, i - ref, match_length)))
+				return 0;
+
+			i += match_length;
+			anchor = i;
+		}
+		else
+		{
+			++i;
+		}
+	}
+
+	// trailing literals, the decoder stops when the input runs out after a literal run
+	if (!(op = lz_write_sequence(op, end, in + anchor, length - anchor, 0, 0)))
+		return 0;
+
+	return op - out;
+}
+
+static const uint8_t* lz_read_length(const uint8_t* ip, const uint8_t* end, size_t* length)
+{
+	uint8_t v;
+	do
+	{
+		if (ip >= end)
+			return NULL;
+		v = *ip++;
+		*length += v;
+	}
+	while (v == 255);
+
+	return ip;
+}
+
+int lz_decompress(const uint8_t* in, size_t length, uint8_t* out, size_t maxout)
+{
+	const uint8_t* ip = in;
+	const uint8_t* ip_end = in + length;
+	uint8_t* op = out;
+	uint8_t* op_end = out + maxout;
+
+	while (ip < ip_end)
+	{
+		uint8_t token = *ip++;
+
+		size_t literal_count = token >> 4;
+		if (literal_count == 15 && !(ip = lz_read_length(ip, ip_end, &literal_count)))
+			return -1;
+
+		if ((size_t)(ip_end - ip) < literal_count || (size_t)(op_end - op) < literal_count)
+			return -1;
+		memcpy(op, ip, literal_count);
+		ip += literal_count;
+		op += literal_count;
+
+		if (ip == ip_end)
+			break;
+
+		if (ip_end - ip < 2)
+			return -1;
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		size_t match_length = token & 0x0f;
+		if (match_length == 15 && !(ip = lz_read_length(ip, ip_end, &match_length)))
+			return -1;
+		match_length += LZ_MIN_MATCH;
+
+		if (offset == 0 || offset > (size_t)(op - out) || (size_t)(op_end - op) < match_length)
+			return -1;
+
+		const uint8_t* ref = op - offset;
+		if (offset >= match_length)
+		{
+			memcpy(op, ref, match_length);
+			op += match_length;
+		}
+		else
+		{
+			for (size_t i = 0; i < match_length; ++i)
+				*op++ = *ref++;
+		}
+	}
+
+	return op - out;
+}
+
+#define RANS_SCALE_BITS (12)
+#define RANS_SCALE (1 << RANS_SCALE_BITS)
+#define RANS_L (1U << 23)
+
+static void rans_normalize(const uint32_t* counts, size_t total, uint32_t* freqs)
+{
+	uint32_t sum = 0;
+	size_t largest = 0;
+
+	for (size_t i = 0; i < 256; ++i)
+	{
+		freqs[i] = 0;
+		if (!counts[i])
+			continue;
+
+		uint64_t scaled = ((uint64_t)counts[i] * RANS_SCALE) / total;
+		freqs[i] = scaled > 0 ? scaled : 1;
+		sum += freqs[i];
+
+		if (freqs[i] > freqs[largest])
+			largest = i;
+	}
+
+	if (sum < RANS_SCALE)
+	{
+		freqs[largest] += RANS_SCALE - sum;
+		return;
+	}
+
+	// rounding rare symbols up to 1 can overshoot, take it back from the most frequent ones
+	while (sum > RANS_SCALE)
+	{
+		size_t best = 0;
+		for (size_t i = 1; i < 256; ++i)
+		{
+			if (freqs[i] > freqs[best])
+				best = i;
+		}
+
+		freqs[best]--;
+		sum--;
+	}
+}
+
+size_t rans_compress(const uint8_t* in, size_t length, uint8_t* out, size_t maxout)
+{
+	uint32_t counts[256];
+	uint32_t freqs[256];
+	uint32_t starts[256];
+
+	if (length == 0)
+		return 0;
+
+	memset(counts, 0, sizeof(counts));
+	for (size_t i = 0; i < length; ++i)
+		counts[in[i]]++;
+
+	rans_normalize(counts, length, freqs);
+
+	// table: 256-bit presence mask followed by the frequency of each present symbol (1 or 2 bytes)
+	uint8_t* op = out;
+	const uint8_t* end = out + maxout;
+
+	if (maxout < 32)
+		return 0;
+	memset(op, 0, 32);
+	for (size_t i = 0; i < 256; ++i)
+	{
+		if (freqs[i])
+			op[i >> 3] |= 1 << (i & 7);
+	}
+	op += 32;
+
+	uint32_t start = 0;
+	for (size_t i = 0; i < 256; ++i)
+	{
+		starts[i] = start;
+		start += freqs[i];
+
+		if (!freqs[i])
+			continue;
+
+		uint32_t f = freqs[i] - 1;
+		if (f < 0x80)
+		{
+			if (op >= end)
+				return 0;
+			*op++ = f;
+		}
+		else
+		{
+			if (end - op < 2)
+				return 0;
+			*op++ = 0x80 | (f >> 8);
+			*op++ = f & 0xff;
+		}
+	}
+
+	// symbols are encoded back to front, so the stream is built from the end of the output buffer
+	uint8_t* ptr = out + maxout;
+	uint32_t x = RANS_L;
+
+	for (size_t i = length; i-- > 0;)
+	{
+		uint8_t s = in[i];
+		uint32_t f = freqs[s];
+		uint32_t x_max = ((RANS_L >> RANS_SCALE_BITS) << 8) * f;
+
+		while (x >= x_max)
+		{
+			if (ptr <= op)
+				return 0;
+			*--ptr = x & 0xff;
+			x >>= 8;
+		}
+
+		x = ((x / f) << RANS_SCALE_BITS) + (x % f) + starts[s];
+	}
+
+	if (ptr - op < 4)
+		return 0;
+	*--ptr = x >> 24;
+	*--ptr = x >> 16;
+	*--ptr = x >> 8;
+	*--ptr = x;
+
+	size_t size = (out + maxout) - ptr;
+	memmove(op, ptr, size);
+
+	return (op - out) + size;
+}
+
+int rans_decompress(const uint8_t* in, size_t length, uint8_t* out, size_t maxout)
+{
+	uint32_t freqs[256];
+	uint32_t starts[256];
+	uint8_t symbols[RANS_SCALE];
+
+	const uint8_t* ip = in;
+	const uint8_t* end = in + length;
+
+	if (length < 32)
+		return -1;
+
+	const uint8_t* mask = ip;
+	ip += 32;
+
+	uint32_t start = 0;
+	for (size_t i = 0; i < 256; ++i)
+	{
+		freqs[i] = 0;
+		starts[i] = start;
+
+		if (!(mask[i >> 3] & (1 << (i & 7))))
+			continue;
+
+		if (ip >= end)
+			return -1;
+
+		uint32_t f = *ip++;
+		if (f & 0x80)
+		{
+			if (ip >= end)
+				return -1;
+			f = ((f & 0x7f) << 8) | *ip++;
+		}
+		freqs[i] = f + 1;
+
+		if (start + freqs[i] > RANS_SCALE)
+			return -1;
+
+		memset(symbols + start, i, freqs[i]);
+		start += freqs[i];
+	}
+
+	if (start != RANS_SCALE || end - ip < 4)
+		return -1;
+
+	uint32_t x = ip[0] | (ip[1] << 8) | (ip[2] << 16) | ((uint32_t)ip[3] << 24);
+	ip += 4;
+
+	for (size_t i = 0; i < maxout; ++i)
+	{
+		uint32_t slot = x & (RANS_SCALE - 1);
+		uint8_t s = symbols[slot];
+
+		out[i] = s;
+		x = freqs[s] * (x >> RANS_SCALE_BITS) + slot - starts[s];
+
+		while (x < RANS_L)
+		{
+			if (ip >= end)
+				return -1;
+			x = (x << 8) | *ip++;
+		}
+	}
+
+	// decoding ends back in the encoder's initial state with all input consumed
+	if (x != RANS_L || ip != end)
+		return -1;
+
+	return maxout;
+}
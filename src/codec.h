@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// byte-oriented LZ (token/literals/16-bit offset), no bit i/o on decode
+size_t lz_compress(const uint8_t* in, size_t length, uint8_t* out, size_t maxout);
+int lz_decompress(const uint8_t* in, size_t length, uint8_t* out, size_t maxout);
+
+// order-0 rANS over bytes with a 12-bit normalized frequency table
+size_t rans_compress(const uint8_t* in, size_t length, uint8_t* out, size_t maxout);
+int rans_decompress(const uint8_t* in, size_t length, uint8_t* out, size_t maxout);
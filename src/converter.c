@@ -1,10 +1,15 @@
 #include "renderer.h"
 #include "stream.h"
 #include "frames.h"
+#include "decoder.h"
 #include "bits.h"
+#include "jobs.h"
 
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #define FIRST_INDEX (1)
 //#define LAST_INDEX (250)
@@ -12,51 +17,261 @@
 #define LAST_INDEX (5478)
 #endif
 
+#define PLANES (1) // bitplanes, above 1 the gray levels are sliced into planes sharing the dictionary
+#define THRESHOLD (200) // single plane threshold
+
 #define MAX_BLOCK_ERROR (8)
 #define BLOCK_PASSES (10)
 #define MAX_TILE_ERROR (32)
+#define MAX_FRAME_ERROR (8)
+#define MAX_FRAME_UPDATES (0)
+#define MAX_FRAME_BYTES (0)
+#define MAX_FRAME_CYCLES (0) // 0 for no cap, COST_FRAME_BUDGET for 25fps on the target
+#define BLOCK_VARIANTS (BLOCK_VARIANTS_ALL) // BLOCK_VARIANTS_BLITTER keeps flip x, and the cpu, out of the stream
+#define MIN_METATILE_USES (4) // with STREAM_FLAG_METATILES, metatiles used fewer times are dropped
+#define CACHE_TILES (512) // with STREAM_FLAG_TILE_CACHE, tile slots in the decoder, 0 for the whole dictionary
+#define CACHE_BLOCKS (1024) // with STREAM_FLAG_TILE_CACHE, block slots in the decoder, 0 for the whole dictionary
+#define DECODE_BUDGET (STREAM_DECODE_COST_ENTROPY)
+#define STREAM_FLAGS (STREAM_FLAG_HUFFMAN_FRAMES|STREAM_FLAG_FRAME_OPS|STREAM_FLAG_SOLID|STREAM_FLAG_FRAME_REPEAT|STREAM_FLAG_TILE_CACHE)
+#define DICTIONARY_ORDER (STREAM_ORDER_FREQUENCY)
+#define SCENE_CUT (0) // percent of tiles changing from one frame to the next that starts a new segment, 0 for one segment
+#define SCENE_TILE_ERROR (MAX_TILE_ERROR) // pixels a tile has to change by to count towards a cut
+#define MIN_SEGMENT_FRAMES (25)
+#define MAX_SEGMENT_FRAMES (0) // long scenes are cut anyway, 0 for no limit
+#define SINGLE_SEGMENT_SIZE (0) // with more than one segment, also encode the clip whole and print what the cuts cost
 
-int main(int argc, char* argv[])
+/*
+    segments are ingested and optimized on their own cores, each with its own dictionary, and merged
+    in order afterwards
+*/
+typedef struct segment_t
 {
-	uint8_t input[FRAME_WIDTH * FRAME_HEIGHT];
+	int first;
+	int last;
+	const uint8_t* images; // the clip's frames from FIRST_INDEX, loaded once by the scene cut pass
+	stream_t* stream;
+	double elapsed; // ms
+} segment_t;
 
-	if (renderer_create(FRAME_WIDTH, FRAME_HEIGHT, RENDER_VISIBLE) < 0)
+static double elapsed_ms(const struct timespec* start)
+{
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) * 1000.0 + (end.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+// bit plane of the gray level of every pixel as 0 / 255, levels spread evenly over 0-255
+static void slice_plane(uint8_t* out, const uint8_t* in, size_t plane, size_t planes)
+{
+	for (size_t i = 0; i < FRAME_WIDTH * FRAME_HEIGHT; ++i)
+	{
+		size_t level = (in[i] << planes) >> 8;
+		out[i] = ((level >> plane) & 1) ? 255 : 0;
+	}
+}
+
+static int load_image(uint8_t* input, int index)
+{
+	char path[256];
+	sprintf(path, "images/image-%04d.raw", index);
+
+	FILE* fp = fopen(path, "rb");
+	if (!fp)
 		return -1;
 
-	stream_t* stream = stream_create();
-	frames_t* frames = &(stream->frames);
-	tiles_t* tiles = &(stream->tiles);
-	size_t actual = 0;
+	int result = fread(input, FRAME_WIDTH*FRAME_HEIGHT, 1, fp) < 1 ? -1 : 0;
+	fclose(fp);
+	return result;
+}
 
-	for (int index = FIRST_INDEX; index <= LAST_INDEX; ++index)
+static uint8_t pixel_level(uint8_t in)
+{
+	return PLANES > 1 ? (in << PLANES) >> 8 : in > THRESHOLD;
+}
+
+// tiles that differ from last in more than SCENE_TILE_ERROR pixels
+static size_t changed_tiles(const uint8_t* last, const uint8_t* curr)
+{
+	size_t changed = 0;
+	for (int y = 0; y < FRAME_HEIGHT; y += TILE_HEIGHT)
 	{
-		char path[256];
-		sprintf(path, "images/image-%04d.raw", index);
+		for (int x = 0; x < FRAME_WIDTH; x += TILE_WIDTH)
+		{
+			size_t error = 0;
+			for (int ty = 0; ty < TILE_HEIGHT; ++ty)
+			{
+				const uint8_t* a = last + x + (y + ty) * FRAME_WIDTH;
+				const uint8_t* b = curr + x + (y + ty) * FRAME_WIDTH;
+				for (int tx = 0; tx < TILE_WIDTH; ++tx)
+					error += pixel_level(a[tx]) != pixel_level(b[tx]);
+			}
+			changed += error > SCENE_TILE_ERROR;
+		}
+	}
+	return changed;
+}
 
-		FILE* fp = fopen(path, "rb");
-		if (!fp)
-			break;
+/*
+    decodes the saved stream again and compares every map with the one encoded, tile by tile as pixels since
+    the decoder numbers its tiles its own way. catches cache maps held over slots that changed under them
+*/
+static int check_round_trip(const stream_t* stream, const char* path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
 
-		if (fread(input, FRAME_WIDTH*FRAME_HEIGHT, 1, fp) < 1)
-			break;
+	decoder_t* decoder = decoder_open_fd(fd);
+	close(fd);
+
+	if (!decoder)
+		return -1;
+
+	uint8_t expected[TILE_WIDTH * TILE_HEIGHT], decoded[TILE_WIDTH * TILE_HEIGHT];
+	size_t maps = 0, wrong = 0, count = buffer_count(&(stream->frames.buffer));
+
+	for (const frame_t* frames; maps < count && (frames = decoder_next_tilemap(decoder, NULL));)
+	{
+		for (size_t k = 0; k < decoder->planes; ++k, ++maps)
+		{
+			const frame_t* frame = buffer_get(&(stream->frames.buffer), maps);
+			for (size_t p = 0; p < FRAME_TILE_COUNT; ++p)
+			{
+				tile_t tile = tiles_get(&(stream->tiles), frame->tiles[p]);
+				tile_render(expected, &(stream->tiles), &tile, frame->tiles[p] & TILE_BITS_MASK, TILE_WIDTH);
+				tile = tiles_get(&(decoder->stream->tiles), frames[k].tiles[p]);
+				tile_render(decoded, &(decoder->stream->tiles), &tile, frames[k].tiles[p] & TILE_BITS_MASK, TILE_WIDTH);
+
+				if (memcmp(expected, decoded, sizeof(expected)))
+				{
+					++wrong;
+					break;
+				}
+			}
+		}
+	}
+
+	decoder_close(decoder);
+
+	fprintf(stderr, "round trip: %lu of %lu maps decoded, %lu differ\n", maps, count, wrong);
+	return (wrong || maps != count) ? -1 : 0;
+}
+
+static stream_t* create_stream()
+{
+	stream_t* stream = stream_create();
+	stream->flags = STREAM_FLAGS;
+	stream->decode_budget = DECODE_BUDGET;
+	stream->cache_tiles = CACHE_TILES;
+	stream->cache_blocks = CACHE_BLOCKS;
+	stream->tiles.variants = BLOCK_VARIANTS;
+	stream->tiles.blocks.variants = BLOCK_VARIANTS;
+	if (STREAM_FLAGS & STREAM_FLAG_SOLID)
+		tiles_reserve_solid(&(stream->tiles));
+
+	stream->frames.planes = PLANES;
+
+	return stream;
+}
+
+static void encode_segment(void* context, size_t i)
+{
+	segment_t* segment = (segment_t*)context + i;
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	uint8_t plane[FRAME_WIDTH * FRAME_HEIGHT];
 
-		fclose(fp);
+	stream_t* stream = create_stream();
+	frames_t* frames = &(stream->frames);
+	tiles_t* tiles = &(stream->tiles);
 
-		frame_t frame;
-		tile_index_t* indices = frame.tiles;
+	for (int index = segment->first; index <= segment->last; ++index)
+	{
+		const uint8_t* input = segment->images + (size_t)(index - FIRST_INDEX) * FRAME_WIDTH * FRAME_HEIGHT;
 
-		for (int y = 0; y < FRAME_HEIGHT; y += TILE_HEIGHT)
+		for (size_t k = 0; k < PLANES; ++k)
 		{
-			for (int x = 0; x < FRAME_WIDTH; x += TILE_WIDTH)
+			const uint8_t* pixels = input;
+			uint8_t threshold = THRESHOLD;
+			if (PLANES > 1)
 			{
-				tile_t tile;
+				slice_plane(plane, input, k, PLANES);
+				pixels = plane;
+				threshold = 127;
+			}
 
-				*(indices++) = tiles_insert(tiles, input + x + y * FRAME_WIDTH, 200, FRAME_WIDTH);
-				++ actual;
+			frame_t frame;
+			tile_index_t* indices = frame.tiles;
+
+			for (int y = 0; y < FRAME_HEIGHT; y += TILE_HEIGHT)
+			{
+				for (int x = 0; x < FRAME_WIDTH; x += TILE_WIDTH)
+				{
+					*(indices++) = tiles_insert(tiles, pixels + x + y * FRAME_WIDTH, threshold, FRAME_WIDTH);
+				}
 			}
+
+			frames_add(frames, &frame);
 		}
+	}
+
+    stream_optimize_blocks(stream, BLOCK_PASSES, MAX_BLOCK_ERROR);
+    stream_optimize_tiles(stream, MAX_TILE_ERROR);
+    stream_optimize_frames(stream, MAX_FRAME_ERROR);
+
+	segment->stream = stream;
+	segment->elapsed = elapsed_ms(&start);
+}
+
+// everything between encoding the maps and saving them
+static void finish_stream(stream_t* stream)
+{
+    stream_rate_control(stream, MAX_FRAME_UPDATES, MAX_FRAME_BYTES, MAX_FRAME_CYCLES);
+    stream_reorder(stream, DICTIONARY_ORDER);
+    stream_patch_tiles(stream);
+    stream_build_metatiles(stream, MIN_METATILE_USES);
+}
+
+int main(int argc, char* argv[])
+{
+	uint8_t input[FRAME_WIDTH * FRAME_HEIGHT];
+
+	if (renderer_create(FRAME_WIDTH, FRAME_HEIGHT, RENDER_VISIBLE) < 0)
+		return -1;
+
+	// cut the clip where most of the screen changes at once
+	buffer_t segments;
+	buffer_init(&segments, sizeof(segment_t));
+	segment_t* segment = NULL;
+
+	// the images stay in memory for the segments, the files are read once
+	buffer_t images;
+	buffer_init(&images, 1);
+
+	for (int index = FIRST_INDEX; index <= LAST_INDEX; ++index)
+	{
+		if (load_image(input, index) < 0)
+			break;
 
-		frames_add(frames, &frame);
+		// signed, so the tests below stay quiet when a knob is 0
+		const uint8_t* last = segment ? buffer_get(&images, buffer_count(&images) - sizeof(input)) : NULL;
+		int changed = segment ? (int)changed_tiles(last, input) : FRAME_TILE_COUNT;
+		int length = segment ? index - segment->first : 0;
+
+		int cut = !segment;
+		cut |= SCENE_CUT && changed * 100 >= SCENE_CUT * FRAME_TILE_COUNT && length >= MIN_SEGMENT_FRAMES;
+		cut |= MAX_SEGMENT_FRAMES && length >= MAX_SEGMENT_FRAMES;
+		if (cut)
+		{
+			segment = buffer_alloc(&segments, 1);
+			segment->first = index;
+			segment->stream = NULL;
+			segment->elapsed = 0;
+		}
+		segment->last = index;
+		buffer_add(&images, input, sizeof(input));
 
         if (index % 10 == 0)
         {
@@ -64,16 +279,60 @@ int main(int argc, char* argv[])
                 return 0;
         }
 
-		fprintf(stderr, "\rpath: %s, frames: %lu tiles: %lu/%lu blocks: %lu", path, buffer_count(&(frames->buffer)), buffer_count(&(tiles->buffer)), actual, buffer_count(&(tiles->blocks.buffer)));
+		fprintf(stderr, "\rframe: %d, changed tiles: %d, segments: %lu", index, changed, buffer_count(&segments));
 	}
 
 	renderer_destroy();
 
     fprintf(stderr, "\n");
 
-    stream_optimize_blocks(stream, BLOCK_PASSES, MAX_BLOCK_ERROR);
-    stream_optimize_tiles(stream, MAX_TILE_ERROR);
-//    stream_optimize_frames(stream);
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	// the clip as a whole goes last, next to the segments
+	size_t count = buffer_count(&segments);
+	if (SINGLE_SEGMENT_SIZE && count > 1)
+	{
+		segment_t* whole = buffer_alloc(&segments, 1);
+		*whole = *(segment_t*)buffer_get(&segments, 0);
+		whole->last = ((segment_t*)buffer_get(&segments, count - 1))->last;
+	}
+
+	for (size_t i = 0; i < buffer_count(&segments); ++i)
+		((segment_t*)buffer_get(&segments, i))->images = images.data;
+
+	jobs_run(encode_segment, segments.data, buffer_count(&segments));
+	buffer_release(&images);
+	stream_t* whole = buffer_count(&segments) > count ? ((segment_t*)buffer_get(&segments, count))->stream : NULL;
+
+	double encoded = elapsed_ms(&start), longest = 0, total = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		const segment_t* curr = buffer_get(&segments, i);
+		fprintf(stderr, "segment %lu: frames %d-%d, %lu tiles, %lu blocks, %.0f ms\n", i, curr->first, curr->last,
+			buffer_count(&(curr->stream->tiles.buffer)), buffer_count(&(curr->stream->tiles.blocks.buffer)), curr->elapsed);
+		longest = curr->elapsed > longest ? curr->elapsed : longest;
+		total += curr->elapsed;
+	}
+
+	// later segments are merged into the first, their near matches only meet from here on
+	stream_t* stream = count ? ((segment_t*)buffer_get(&segments, 0))->stream : create_stream();
+	for (size_t i = 1; i < count; ++i)
+	{
+		segment_t* curr = buffer_get(&segments, i);
+		stream_merge(stream, curr->stream);
+		stream_destroy(curr->stream);
+	}
+	buffer_release(&segments);
+
+	// only exact matches are merged, matching again would stack up the error. reuse across the cuts is left
+	if (count > 1)
+		stream_optimize_frames(stream, MAX_FRAME_ERROR);
+
+	fprintf(stderr, "encoded %lu segments in %.0f ms (longest %.0f ms, %.0f ms together), merged in %.0f ms\n",
+		count, encoded, longest, total, elapsed_ms(&start) - encoded);
+
+	finish_stream(stream);
 
 	fprintf(stderr, "\nsaving...\n");
 
@@ -83,8 +342,36 @@ int main(int argc, char* argv[])
 		fprintf(stderr, "failed to save stream\n");
 		return -1;
 	}
+	long size = ftell(out);
 	fclose(out);
 
+	// saved the same way, but nowhere
+	if (whole)
+	{
+		fprintf(stderr, "\nsaving the clip as one segment...\n");
+
+		finish_stream(whole);
+		FILE* temp = tmpfile();
+		if (temp && stream_save(whole, temp) >= 0)
+			fprintf(stderr, "%lu segments: %ld bytes, one segment: %ld bytes, the cuts cost %+.1f%%\n",
+				count, size, ftell(temp), ftell(temp) > 0 ? (size - ftell(temp)) * 100.0 / ftell(temp) : 0.0);
+		if (temp)
+			fclose(temp);
+		stream_destroy(whole);
+	}
+
+	if (check_round_trip(stream, "anim.bin") < 0)
+	{
+		fprintf(stderr, "anim.bin does not decode to the encoded maps\n");
+		return -1;
+	}
+
+	FILE* report = fopen("anim.cost", "w");
+	if (!report || stream_cost_report(stream, MAX_FRAME_CYCLES, report) < 0)
+		fprintf(stderr, "failed to write cost report\n");
+	if (report)
+		fclose(report);
+
 	stream_destroy(stream);
 
 	return 0;
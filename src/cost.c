@@ -0,0 +1,66 @@
+#include "cost.h"
+
+#include <string.h>
+
+void cost_init(cost_model_t* model)
+{
+	model->frame = 2000;
+	model->run = 40;
+	model->literal = 80;
+	model->blit = 120; // register setup dominates, an 8x8 word blit is short
+	model->cpu_block = 260; // 8 table lookups and byte writes
+	model->fill = 60;
+	model->fetch_byte = 4;
+}
+
+void cost_frame(frame_cost_t* out, const cost_model_t* model, const tiles_t* tiles, const frame_t* last, const frame_t* curr, size_t tile_bits, size_t block_bits, uint32_t flags)
+{
+	frame_stats_t stats;
+	frames_stats(&stats, last, curr, tile_bits, flags);
+
+	memset(out, 0, sizeof(frame_cost_t));
+	out->runs = stats.runs;
+	out->literals = stats.literals;
+	out->tiles = stats.changed;
+	out->bytes = stats.bytes;
+
+	// a tile entry is its block indices at the width the target stores them, each block its bitmap
+	size_t entry_bytes = (block_bits > 16 ? sizeof(uint32_t) : sizeof(uint16_t)) * TILE_INDEX_COUNT;
+
+	for (size_t j = 0; j < FRAME_TILE_COUNT; ++j)
+	{
+		if (curr->tiles[j] == last->tiles[j])
+			continue;
+
+		// a solid tile is filled straight from its index, nothing is fetched
+		if (tiles->blocks.solid && (curr->tiles[j] & ~TILE_BITS_MASK) == TILE_SOLID)
+		{
+			out->fills += TILE_INDEX_COUNT;
+			continue;
+		}
+
+		// flip x on the tile ends up on all of its blocks, so classify the resolved block indices
+		tile_t tile = tiles_get(tiles, curr->tiles[j]);
+		for (size_t k = 0; k < TILE_INDEX_COUNT; ++k)
+		{
+			if (tiles->blocks.solid && (tile.indices[k] & ~BLOCK_BITS_MASK) == BLOCK_SOLID)
+				++out->fills;
+			else if (tile.indices[k] & BLOCK_FLIP_X)
+				++out->cpu_blocks;
+			else
+				++out->blits;
+		}
+
+		out->fetch_bytes += entry_bytes;
+	}
+
+	out->fetch_bytes += (out->blits + out->cpu_blocks) * sizeof(((block_t*)0)->bits);
+
+	out->cycles = model->frame;
+	out->cycles += (uint64_t)out->runs * model->run;
+	out->cycles += (uint64_t)out->literals * model->literal;
+	out->cycles += (uint64_t)out->blits * model->blit;
+	out->cycles += (uint64_t)out->cpu_blocks * model->cpu_block;
+	out->cycles += (uint64_t)out->fills * model->fill;
+	out->cycles += (uint64_t)out->fetch_bytes * model->fetch_byte;
+}
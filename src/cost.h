@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "frames.h"
+#include "tiles.h"
+
+/*
+    rough decode cost of a frame on the target, in cpu cycles. the defaults are ballpark figures
+    for a 7MHz 68000 with the blitter doing the blitter friendly block variants (none, flip y, invert)
+    and the cpu doing everything that needs flip x through a reverse table
+*/
+
+#define COST_CLOCK (7093790) // PAL 68000
+#define COST_FRAME_RATE (25)
+#define COST_FRAME_BUDGET (COST_CLOCK / COST_FRAME_RATE)
+
+typedef struct cost_model_t
+{
+	uint32_t frame; // fixed per frame, header parse and buffer swap
+	uint32_t run; // per run header decoded
+	uint32_t literal; // per literal tile index decoded
+	uint32_t blit; // per block drawn by the blitter
+	uint32_t cpu_block; // per block drawn by the cpu
+	uint32_t fill; // per solid block, a destination only blit
+	uint32_t fetch_byte; // per byte read from the tile and block dictionaries
+} cost_model_t;
+
+typedef struct frame_cost_t
+{
+	uint64_t cycles;
+
+	size_t runs;
+	size_t literals;
+	size_t tiles; // tiles redrawn
+	size_t blits;
+	size_t cpu_blocks;
+	size_t fills;
+	size_t fetch_bytes;
+	size_t bytes; // encoded frame map size
+} frame_cost_t;
+
+void cost_init(cost_model_t* model);
+
+void cost_frame(frame_cost_t* out, const cost_model_t* model, const tiles_t* tiles, const frame_t* last, const frame_t* curr, size_t tile_bits, size_t block_bits, uint32_t flags);
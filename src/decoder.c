@@ -0,0 +1,271 @@
+#include "decoder.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+static decoder_t* decoder_open(decoder_t* decoder)
+{
+	decoder->stream = stream_create();
+	buffer_init(&(decoder->sections), 1);
+	decoder->scratch = NULL;
+
+	stream_t* stream = decoder->stream;
+	long offset = stream_open(stream, &(decoder->file), &(decoder->header), &(decoder->sections));
+	if (offset < 0 || frames_decoder_init(&(decoder->maps), &(decoder->sections), offset, decoder->header.frames * decoder->header.planes, decoder->header.planes,
+		&(stream->tiles), &(stream->metatiles), decoder->header.tile_bits, decoder->header.block_bits, decoder->header.flags) < 0)
+	{
+		stream_destroy(decoder->stream);
+		buffer_release(&(decoder->sections));
+		buffer_release(&(decoder->file));
+		free(decoder);
+		return NULL;
+	}
+
+	decoder->frames = decoder->header.frames;
+	decoder->planes = decoder->header.planes;
+	decoder->frame = 0;
+	decoder->in_place = (decoder->header.flags & STREAM_FLAG_TILE_CACHE) != 0;
+	decoder->drawn = 0;
+	decoder->filled = 0;
+	decoder->dirty_count = 0;
+	decoder->reset = 1;
+	memset(decoder->current, 0xff, sizeof(decoder->current));
+
+	for (size_t p = 0; p < FRAME_TILE_COUNT; ++p)
+		decoder->all[p] = p;
+
+	if (decoder->planes > 1)
+		decoder->scratch = malloc(decoder->planes * FRAME_WIDTH * FRAME_HEIGHT);
+
+	return decoder;
+}
+
+decoder_t* decoder_open_buffer(const uint8_t* data, size_t size)
+{
+	decoder_t* decoder = malloc(sizeof(decoder_t));
+	buffer_init(&(decoder->file), 1);
+	buffer_set(&(decoder->file), data, size);
+
+	return decoder_open(decoder);
+}
+
+decoder_t* decoder_open_fd(int fd)
+{
+	decoder_t* decoder = malloc(sizeof(decoder_t));
+	buffer_init(&(decoder->file), 1);
+
+	uint8_t chunk[65536];
+	for (ssize_t n; (n = read(fd, chunk, sizeof(chunk))) > 0;)
+		buffer_add(&(decoder->file), chunk, n);
+
+	return decoder_open(decoder);
+}
+
+void decoder_close(decoder_t* decoder)
+{
+	frames_decoder_release(&(decoder->maps));
+	stream_destroy(decoder->stream);
+
+	free(decoder->scratch);
+	buffer_release(&(decoder->sections));
+	buffer_release(&(decoder->file));
+	free(decoder);
+}
+
+const frame_t* decoder_next_tilemap(decoder_t* decoder, int* held)
+{
+	if (decoder->frame >= decoder->frames)
+		return NULL;
+
+	uint8_t changed[FRAME_TILE_COUNT];
+	memset(changed, decoder->reset, sizeof(changed));
+
+	size_t repeats = 0;
+	for (size_t k = 0; k < decoder->planes; ++k)
+	{
+		frame_t map;
+		int result = frames_decoder_next(&(decoder->maps), &map);
+		if (result < 0)
+			return NULL;
+		repeats += result;
+
+		frame_t* current = &(decoder->current[k]);
+		for (size_t p = 0; p < FRAME_TILE_COUNT; ++p)
+			changed[p] |= map.tiles[p] != current->tiles[p];
+		*current = map;
+	}
+
+	// a slot the maps of this frame uploaded into shows something else under the same index
+	const uint32_t* uploaded = decoder->maps.uploaded;
+	for (size_t k = 0; k < decoder->planes && uploaded; ++k)
+	{
+		for (size_t p = 0; p < FRAME_TILE_COUNT; ++p)
+			changed[p] |= uploaded[decoder->current[k].tiles[p] & ~TILE_BITS_MASK] > decoder->frame * decoder->planes;
+	}
+
+	decoder->dirty_count = 0;
+	for (size_t p = 0; p < FRAME_TILE_COUNT; ++p)
+	{
+		if (changed[p])
+			decoder->dirty[decoder->dirty_count++] = p;
+	}
+	decoder->reset = 0;
+
+	++(decoder->frame);
+	if (held)
+		*held = repeats == decoder->planes;
+
+	return decoder->current;
+}
+
+// counts[0] tiles drawn, counts[1] solid tiles filled
+static void render_map(const tiles_t* tiles, const frame_t* frame, const uint16_t* positions, size_t count, uint8_t* pixels, size_t pitch, uint32_t format, size_t* counts)
+{
+	for (size_t i = 0; i < count; ++i)
+	{
+		size_t p = positions[i];
+		size_t x = (p % FRAME_TILES_X) * TILE_WIDTH, y = (p / FRAME_TILES_X) * TILE_HEIGHT;
+
+		tile_index_t ti = frame->tiles[p];
+		uint8_t* target = (format == DECODER_FORMAT_1BPP) ? &pixels[x / 8 + y * pitch] : &pixels[x + y * pitch];
+
+		if (tiles->blocks.solid && (ti & ~TILE_BITS_MASK) == TILE_SOLID)
+		{
+			uint8_t value = (ti & TILE_INVERT) ? 255 : 0;
+			if (format == DECODER_FORMAT_1BPP)
+				tile_fill_bits(target, value, pitch);
+			else
+				tile_fill(target, value, pitch);
+			++counts[1];
+			continue;
+		}
+
+		if (format == DECODER_FORMAT_1BPP)
+			tiles_render_bits(target, tiles, ti, pitch);
+		else
+			tiles_render(target, tiles, ti, pitch);
+		++counts[0];
+	}
+}
+
+// only reads the decoder, scratch holds a frame per plane for combining planes
+static void render_maps(const decoder_t* decoder, const frame_t* maps, const uint16_t* positions, size_t count, uint8_t* pixels, size_t pitch, uint32_t format, uint8_t* scratch, size_t* counts)
+{
+	const tiles_t* tiles = &(decoder->stream->tiles);
+
+	size_t planes = decoder->planes;
+	if (format == DECODER_FORMAT_PLANAR)
+	{
+		for (size_t k = 0; k < planes; ++k)
+			render_map(tiles, &maps[k], positions, count, pixels + k * pitch * FRAME_HEIGHT, pitch, DECODER_FORMAT_1BPP, counts);
+		return;
+	}
+
+	if (planes == 1 || format == DECODER_FORMAT_1BPP)
+	{
+		render_map(tiles, &maps[planes - 1], positions, count, pixels, pitch, format, counts);
+		return;
+	}
+
+	// bitplanes back to gray, plane k is bit k of the level
+	for (size_t k = 0; k < planes; ++k)
+		render_map(tiles, &maps[k], positions, count, scratch + k * FRAME_WIDTH * FRAME_HEIGHT, FRAME_WIDTH, format, counts);
+
+	uint8_t gray[1 << FRAME_MAX_PLANES];
+	size_t levels = (1 << planes) - 1;
+	for (size_t level = 0; level <= levels; ++level)
+		gray[level] = (level * 255) / levels;
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		size_t p = positions[i];
+		size_t x0 = (p % FRAME_TILES_X) * TILE_WIDTH, y0 = (p / FRAME_TILES_X) * TILE_HEIGHT;
+
+		for (size_t y = y0; y < y0 + TILE_HEIGHT; ++y)
+		{
+			uint8_t level[TILE_WIDTH] = { 0 };
+			for (size_t k = 0; k < planes; ++k)
+			{
+				const uint8_t* in = scratch + k * FRAME_WIDTH * FRAME_HEIGHT + y * FRAME_WIDTH + x0;
+				for (size_t x = 0; x < TILE_WIDTH; ++x)
+					level[x] |= in[x] & (1 << k);
+			}
+
+			uint8_t* out = pixels + y * pitch + x0;
+			for (size_t x = 0; x < TILE_WIDTH; ++x)
+				out[x] = gray[level[x]];
+		}
+	}
+}
+
+void decoder_render_maps(decoder_t* decoder, const frame_t* maps, const uint16_t* positions, size_t count, uint8_t* pixels, size_t pitch, uint32_t format)
+{
+	size_t counts[2] = { 0, 0 };
+	render_maps(decoder, maps, positions, count, pixels, pitch, format, decoder->scratch, counts);
+
+	decoder->drawn = counts[0];
+	decoder->filled = counts[1];
+}
+
+void decoder_render_frame(const decoder_t* decoder, const frame_t* maps, uint8_t* pixels, size_t pitch, uint32_t format, uint8_t* scratch)
+{
+	size_t counts[2] = { 0, 0 };
+	render_maps(decoder, maps, decoder->all, FRAME_TILE_COUNT, pixels, pitch, format, scratch, counts);
+}
+
+// before the first map and after a seek there is no map returned to render, current may hold NO_TILE
+void decoder_render(decoder_t* decoder, uint8_t* pixels, size_t pitch, uint32_t format)
+{
+	if (decoder->reset)
+	{
+		decoder->drawn = decoder->filled = 0;
+		return;
+	}
+
+	decoder_render_maps(decoder, decoder->current, decoder->all, FRAME_TILE_COUNT, pixels, pitch, format);
+}
+
+void decoder_render_dirty(decoder_t* decoder, uint8_t* pixels, size_t pitch, uint32_t format)
+{
+	if (decoder->reset)
+	{
+		decoder->drawn = decoder->filled = 0;
+		return;
+	}
+
+	decoder_render_maps(decoder, decoder->current, decoder->dirty, decoder->dirty_count, pixels, pitch, format);
+}
+
+int decoder_next_frame(decoder_t* decoder, uint8_t* pixels, size_t pitch, uint32_t format)
+{
+	int held;
+	if (!decoder_next_tilemap(decoder, &held))
+		return -1;
+
+	decoder_render(decoder, pixels, pitch, format);
+	return held ? DECODER_HELD : 0;
+}
+
+int decoder_seek(decoder_t* decoder, size_t frame)
+{
+	if (frame > decoder->frames)
+		return -1;
+
+	// maps only follow on from the ones before, there is nothing to start over from but the beginning
+	if (frame < decoder->frame)
+	{
+		frames_decoder_rewind(&(decoder->maps));
+		memset(decoder->current, 0xff, sizeof(decoder->current));
+		decoder->frame = 0;
+	}
+
+	while (decoder->frame < frame)
+	{
+		if (!decoder_next_tilemap(decoder, NULL))
+			return -1;
+	}
+
+	decoder->reset = 1;
+	return 0;
+}
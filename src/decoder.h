@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "stream.h"
+#include "frames.h"
+
+#define DECODER_FORMAT_8BPP (0) // a byte per pixel, 0 / 255 or the gray level with more than one plane
+#define DECODER_FORMAT_1BPP (1) // a bit per pixel, leftmost in the top bit. only the top plane with more than one
+#define DECODER_FORMAT_PLANAR (2) // 1bpp for every plane, bitplane k (bit k of the level) at pixels + k * pitch * FRAME_HEIGHT
+
+#define DECODER_HELD (1) // the frame repeats the one before
+
+/*
+    pulls frames out of a stream one at a time. only the dictionaries and the last maps are kept,
+    the frame maps are decoded as they are asked for. with STREAM_FLAG_TILE_CACHE the dictionaries are
+    the slots the stream was made for, the uploads of every frame overwrite them in place
+*/
+typedef struct decoder_t
+{
+	stream_t* stream; // dictionaries and metatiles, stream->frames stays empty
+	stream_header_t header;
+	buffer_t file; // the stream as read from a file, or wrapping the caller's data
+	buffer_t sections; // decompressed
+	frames_decoder_t maps;
+
+	size_t frames;
+	size_t planes;
+	size_t frame; // the next one
+	int in_place; // STREAM_FLAG_TILE_CACHE, maps returned are only good to draw until the next decoder_next_tilemap
+
+	frame_t current[FRAME_MAX_PLANES]; // maps of the last frame, one per plane
+	uint8_t* scratch; // a frame of 8bpp pixels per plane, for combining planes
+
+	uint16_t dirty[FRAME_TILE_COUNT]; // positions where the last maps differ from the ones before, in map order
+	size_t dirty_count;
+	int reset; // nothing shown yet or seeked, every position is dirty
+	uint16_t all[FRAME_TILE_COUNT];
+
+	size_t drawn; // tiles rendered by the last decoder_render
+	size_t filled; // solid tiles filled by the last decoder_render
+} decoder_t;
+
+// data has to stay around until decoder_close
+decoder_t* decoder_open_buffer(const uint8_t* data, size_t size);
+decoder_t* decoder_open_fd(int fd);
+void decoder_close(decoder_t* decoder);
+
+// maps of the next frame, one per plane, NULL after the last or at a map that does not decode. held is set when the frame repeats the one before
+const frame_t* decoder_next_tilemap(decoder_t* decoder, int* held);
+// renders the maps last returned, pitch in bytes. draws nothing before the first decoder_next_tilemap or after a seek
+void decoder_render(decoder_t* decoder, uint8_t* pixels, size_t pitch, uint32_t format);
+// renders only the dirty positions of the maps last returned, over what pixels held after the frame before
+void decoder_render_dirty(decoder_t* decoder, uint8_t* pixels, size_t pitch, uint32_t format);
+/*
+    positions of maps returned before, copied out so that another thread can draw them. the dictionaries only
+    grow until a seek back, so older maps stay valid, but not while decoder_next_tilemap is appending to them.
+    in_place streams only draw the maps last returned
+*/
+void decoder_render_maps(decoder_t* decoder, const frame_t* maps, const uint16_t* positions, size_t count, uint8_t* pixels, size_t pitch, uint32_t format);
+/*
+    a whole frame of maps returned before, only reading the decoder so that several threads can draw at once.
+    scratch is planes * FRAME_WIDTH * FRAME_HEIGHT bytes of their own, only used for 8bpp with more than one plane.
+    in_place streams only draw the maps last returned
+*/
+void decoder_render_frame(const decoder_t* decoder, const frame_t* maps, uint8_t* pixels, size_t pitch, uint32_t format, uint8_t* scratch);
+// decoder_next_tilemap and decoder_render in one, DECODER_HELD for frames repeating the one before, -1 after the last
+int decoder_next_frame(decoder_t* decoder, uint8_t* pixels, size_t pitch, uint32_t format);
+// the frame the next call returns, going back decodes again from the start. the frame after is all dirty
+int decoder_seek(decoder_t* decoder, size_t frame);
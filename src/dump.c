@@ -1,12 +1,175 @@
 #include "renderer.h"
 #include "stream.h"
 #include "frames.h"
+#include "decoder.h"
+#include "jobs.h"
 
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
 
+#define EXPORT_BATCH (64) // frames whose maps are decoded, then rendered across cores and written, at a time
+#define EXPORT_WRITE_BUFFER (1 << 20)
+
+typedef struct export_t
+{
+	const decoder_t* decoder;
+	const char* prefix; // PGM files, NULL for one raw file
+	size_t first; // frame number of maps[0]
+
+	frame_t* maps; // planes per frame
+	uint8_t* pixels; // a frame per batch slot
+	uint8_t* scratch; // planes frames per batch slot, combining planes
+	int failed;
+} export_t;
+
+static double elapsed_ms(const struct timespec* start)
+{
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) * 1000.0 + (end.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+// a PGM file per frame is written by the job that rendered it, a raw file has to go in order afterwards
+static void export_frame(void* context, size_t index)
+{
+	export_t* export = context;
+	const decoder_t* decoder = export->decoder;
+
+	uint8_t* pixels = export->pixels + index * FRAME_WIDTH * FRAME_HEIGHT;
+	uint8_t* scratch = export->scratch ? export->scratch + index * decoder->planes * FRAME_WIDTH * FRAME_HEIGHT : NULL;
+	decoder_render_frame(decoder, &(export->maps[index * decoder->planes]), pixels, FRAME_WIDTH, DECODER_FORMAT_8BPP, scratch);
+
+	if (!export->prefix)
+		return;
+
+	char name[1024];
+	snprintf(name, sizeof(name), "%s-%04lu.pgm", export->prefix, export->first + index);
+
+	FILE* out = fopen(name, "wb");
+	if (!out)
+	{
+		export->failed = 1;
+		return;
+	}
+
+	fprintf(out, "P5\n%d %d\n255\n", FRAME_WIDTH, FRAME_HEIGHT);
+	if (fwrite(pixels, FRAME_WIDTH * FRAME_HEIGHT, 1, out) != 1)
+		export->failed = 1;
+	fclose(out);
+}
+
+/*
+    maps only follow on from the ones before, so they are decoded in order, but once a batch of them is
+    there every frame renders on its own
+*/
+static int export_stream(const char* path, const char* prefix, const char* raw)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	decoder_t* decoder = decoder_open_fd(fd);
+	close(fd);
+
+	if (!decoder)
+		return -1;
+
+	FILE* out = NULL;
+	if (raw)
+	{
+		if (!(out = fopen(raw, "wb")))
+		{
+			decoder_close(decoder);
+			return -1;
+		}
+		setvbuf(out, NULL, _IOFBF, EXPORT_WRITE_BUFFER);
+	}
+
+	export_t export;
+	export.decoder = decoder;
+	export.prefix = prefix;
+	export.failed = 0;
+	export.maps = malloc(sizeof(frame_t) * decoder->planes * EXPORT_BATCH);
+	export.pixels = malloc(FRAME_WIDTH * FRAME_HEIGHT * EXPORT_BATCH);
+	export.scratch = decoder->planes > 1 ? malloc(decoder->planes * FRAME_WIDTH * FRAME_HEIGHT * EXPORT_BATCH) : NULL;
+
+	// maps into the tile cache slots only draw until the next frame is decoded, those go one at a time
+	size_t batch = decoder->in_place ? 1 : EXPORT_BATCH;
+
+	double maps_ms = 0, render_ms = 0, write_ms = 0;
+	struct timespec start, stage;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	size_t frames = 0;
+	for (;;)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &stage);
+
+		size_t count = 0;
+		for (const frame_t* maps; count < batch && (maps = decoder_next_tilemap(decoder, NULL)); ++count)
+			memcpy(&(export.maps[count * decoder->planes]), maps, sizeof(frame_t) * decoder->planes);
+
+		maps_ms += elapsed_ms(&stage);
+		if (!count)
+			break;
+
+		clock_gettime(CLOCK_MONOTONIC, &stage);
+		export.first = frames;
+		jobs_run(export_frame, &export, count);
+		render_ms += elapsed_ms(&stage);
+
+		if (out)
+		{
+			clock_gettime(CLOCK_MONOTONIC, &stage);
+			if (fwrite(export.pixels, FRAME_WIDTH * FRAME_HEIGHT, count, out) != count)
+				export.failed = 1;
+			write_ms += elapsed_ms(&stage);
+		}
+
+		frames += count;
+		if (export.failed)
+			break;
+	}
+
+	if (out && fclose(out) != 0)
+		export.failed = 1;
+
+	double elapsed = elapsed_ms(&start);
+	fprintf(stderr, "%lu frames in %.1f ms, %.0f frames/s on %lu threads\n", frames, elapsed, elapsed > 0 ? frames * 1000.0 / elapsed : 0.0, jobs_concurrency());
+	if (prefix)
+		fprintf(stderr, "maps %.1f ms, render and write %.1f ms\n", maps_ms, render_ms);
+	else
+		fprintf(stderr, "maps %.1f ms, render %.1f ms, write %.1f ms\n", maps_ms, render_ms, write_ms);
+
+	free(export.scratch);
+	free(export.pixels);
+	free(export.maps);
+	decoder_close(decoder);
+
+	return export.failed ? -1 : 0;
+}
+
+/*
+    dump                     the sections of anim.bin as files
+    dump -raw <file>         every frame decoded to 8bpp, one after the other in file
+    dump -pgm <prefix>       every frame decoded to prefix-NNNN.pgm
+*/
 int main(int argc, char* argv[])
 {
+	if (argc > 2 && (!strcmp(argv[1], "-raw") || !strcmp(argv[1], "-pgm")))
+	{
+		int pgm = !strcmp(argv[1], "-pgm");
+		if (export_stream("anim.bin", pgm ? argv[2] : NULL, pgm ? NULL : argv[2]) < 0)
+		{
+			fprintf(stderr, "Could not export stream\n");
+			return -1;
+		}
+		return 0;
+	}
+
 	FILE* in = fopen("anim.bin", "rb");
 	if (!in)
 		return -1;
@@ -1,17 +1,24 @@
 #include "frames.h"
 #include "bits.h"
+#include "huffman.h"
+#include "cache.h"
 
 #include "stream.h"
 
 #include <string.h>
+#include <assert.h>
 
 void frames_init(frames_t* frames)
 {
 	buffer_init(&(frames->buffer), sizeof(frame_t));
+	buffer_init(&(frames->held), sizeof(uint8_t));
+	frames->planes = 1;
+	memset(&(frames->empty), 0xff, sizeof(frame_t));
 }
 
 void frames_release(frames_t* frames)
 {
+	buffer_release(&(frames->held));
 	buffer_release(&(frames->buffer));
 }
 
@@ -19,6 +26,23 @@ void frames_add(frames_t* frames, const frame_t* in)
 {
 	frame_t* temp = buffer_alloc(&(frames->buffer), 1);
 	memcpy(temp, in, sizeof(frame_t));
+
+	uint8_t* held = buffer_alloc(&(frames->held), 1);
+	*held = 0;
+}
+
+const frame_t* frames_last(const frames_t* frames, size_t index)
+{
+	if (index < frames->planes)
+		return &(frames->empty);
+	return buffer_get(&(frames->buffer), index - frames->planes);
+}
+
+int frames_held(const frames_t* frames, size_t index)
+{
+	if (index >= buffer_count(&(frames->held)))
+		return 0;
+	return *(const uint8_t*)buffer_get(&(frames->held), index);
 }
 
 static uint32_t ti_compress(tile_index_t index, size_t bits)
@@ -39,138 +63,1147 @@ static tile_index_t ti_uncompress(uint32_t in, size_t bits)
     return result;
 }
 
-size_t frames_load(const buffer_t* in, size_t offset, size_t count, frames_t* frames, size_t tile_bits)
+#define TILE_FLAGS_SHIFT (29)
+
+// plain run header: FRAME_RUN_SKIP | (length - 1)
+#define FRAME_RUN_SKIP (0x80)
+#define FRAME_RUN_MAX_LENGTH (128)
+
+// STREAM_FLAG_FRAME_OPS run header: (op << FRAME_OP_SHIFT) | (length - 1)
+#define FRAME_OP_SHIFT (5)
+#define FRAME_OP_MAX_LENGTH (32)
+
+#define FRAME_OP_LITERAL (0) // followed by length tile indices
+#define FRAME_OP_SKIP (1) // same tile as the previous frame
+#define FRAME_OP_COPY (2) // followed by a motion byte, tile at (x+dx, y+dy) in the previous frame
+#define FRAME_OP_ABOVE (3) // same tile as the one above in this frame
+#define FRAME_OP_LEFT (4) // repeat the tile before the run
+#define FRAME_OP_PATCH (5) // per tile a 2 bit block slot and a block index replacing that block of the tile shown before
+
+// patches are an op, so they need op runs as well
+#define PATCHING(flags) (((flags) & (STREAM_FLAG_FRAME_PATCH|STREAM_FLAG_FRAME_OPS)) == (STREAM_FLAG_FRAME_PATCH|STREAM_FLAG_FRAME_OPS))
+
+// STREAM_FLAG_FRAME_REPEAT records live in the frame header size and have no map data
+#define FRAME_HEADER_REPEAT (0x8000) // (size & FRAME_HEADER_ARG_MASK) + 1 copies of the previous frame
+#define FRAME_HEADER_REF (0x4000) // the map stored (size & FRAME_HEADER_ARG_MASK) + 1 maps back, see FRAME_HISTORY
+#define FRAME_HEADER_ARG_MASK (0x3fff)
+
+// stored maps a reference can reach back to
+#define FRAME_HISTORY (256)
+
+// STREAM_FLAG_METATILES meta layer: a bit telling if the frame has one, then raw 8 bit run headers over
+// the metatile cells, FRAME_META_RUN | (length - 1) runs followed by that many metatile indices
+#define FRAME_META_RUN (0x80)
+#define FRAME_META_MAX_LENGTH (128)
+
+#define FRAME_META_X (FRAME_TILES_X / METATILE_WIDTH)
+#define FRAME_META_Y (FRAME_TILES_Y / METATILE_HEIGHT)
+#define FRAME_META_COUNT (FRAME_META_X * FRAME_META_Y)
+
+// changed tiles in a cell before a metatile is used for it, cells that mostly stay are cheaper as skips
+#define FRAME_META_MIN_CHANGED (3)
+
+// STREAM_FLAG_TILE_CACHE: a map starts with its block uploads and tile uploads, each list after a count this wide
+#define FRAME_UPLOAD_COUNT_BITS (11)
+
+// frame plan entries: 0 to store a map, a record header, or covered by an earlier repeat record
+#define FRAME_PLAN_MAP (0)
+#define FRAME_PLAN_COVERED (0xffff)
+
+// motion byte: signed 4-bit dx in the high nibble, signed 4-bit dy in the low nibble, in tiles
+#define NO_MOTION (0)
+#define MAX_MOTION (4)
+#define MIN_MOTION_MATCHES (4)
+
+typedef struct frame_run_t
+{
+	uint8_t op;
+	uint8_t length;
+	uint8_t motion;
+	uint16_t start; // index into the frame order, the position is order[start]
+} frame_run_t;
+
+static void frame_coder_release(frame_coder_t* coder)
+{
+	huffman_release(&(coder->runs));
+	huffman_release(&(coder->tiles));
+	huffman_release(&(coder->flags));
+}
+
+static uint8_t encode_motion(int dx, int dy)
+{
+	return ((dx & 0x0f) << 4) | (dy & 0x0f);
+}
+
+static int motion_dx(uint8_t motion)
+{
+	return ((int8_t)motion) >> 4;
+}
+
+static int motion_dy(uint8_t motion)
+{
+	return ((int8_t)(motion << 4)) >> 4;
+}
+
+// tile that a non-literal op produces at position p of a run starting at start, 0 if the op cannot reach p
+static int op_source(uint8_t op, size_t p, size_t start, uint8_t motion, const frame_t* last, const frame_t* curr, tile_index_t* out)
+{
+	switch (op)
+	{
+		case FRAME_OP_SKIP:
+			*out = last->tiles[p];
+			return 1;
+
+		case FRAME_OP_LEFT:
+			if (start == 0)
+				return 0;
+			*out = curr->tiles[start - 1];
+			return 1;
+
+		case FRAME_OP_ABOVE:
+			if (p < FRAME_TILES_X)
+				return 0;
+			*out = curr->tiles[p - FRAME_TILES_X];
+			return 1;
+
+		case FRAME_OP_COPY:
+		{
+			int x = (int)(p % FRAME_TILES_X) + motion_dx(motion);
+			int y = (int)(p / FRAME_TILES_X) + motion_dy(motion);
+			if (x < 0 || y < 0 || x >= FRAME_TILES_X || y >= FRAME_TILES_Y)
+				return 0;
+			*out = last->tiles[x + y * FRAME_TILES_X];
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// global shift detector: the tile offset that explains the most changed tiles
+static uint8_t frame_motion(const frame_t* last, const frame_t* curr)
+{
+	uint8_t best = NO_MOTION;
+	size_t best_count = MIN_MOTION_MATCHES - 1;
+
+	for (int dy = -MAX_MOTION; dy <= MAX_MOTION; ++dy)
+	{
+		for (int dx = -MAX_MOTION; dx <= MAX_MOTION; ++dx)
+		{
+			if (!dx && !dy)
+				continue;
+
+			size_t count = 0;
+			for (int y = dy < 0 ? -dy : 0, ey = dy > 0 ? FRAME_TILES_Y - dy : FRAME_TILES_Y; y < ey; ++y)
+			{
+				for (int x = dx < 0 ? -dx : 0, ex = dx > 0 ? FRAME_TILES_X - dx : FRAME_TILES_X; x < ex; ++x)
+				{
+					tile_index_t ti = curr->tiles[x + y * FRAME_TILES_X];
+					if (ti != last->tiles[x + y * FRAME_TILES_X] && ti == last->tiles[(x + dx) + (y + dy) * FRAME_TILES_X])
+						++count;
+				}
+			}
+
+			if (count > best_count)
+			{
+				best_count = count;
+				best = encode_motion(dx, dy);
+			}
+		}
+	}
+
+	return best;
+}
+
+static const uint8_t frame_op_candidates[] = { FRAME_OP_SKIP, FRAME_OP_LEFT, FRAME_OP_ABOVE, FRAME_OP_COPY };
+
+/*
+    runs cover the positions in order that are still open, all of them unless metatiles filled some already.
+    returns how many there are
+*/
+static size_t frame_order(uint16_t* order, const uint8_t* filled)
+{
+	size_t count = 0;
+	for (size_t p = 0; p < FRAME_TILE_COUNT; ++p)
+	{
+		if (!filled || !filled[p])
+			order[count++] = p;
+	}
+	return count;
+}
+
+// frame position of tile i in metatile cell
+static size_t meta_position(size_t cell, size_t i)
+{
+	size_t x = (cell % FRAME_META_X) * METATILE_WIDTH + (i % METATILE_WIDTH);
+	size_t y = (cell / FRAME_META_X) * METATILE_HEIGHT + (i / METATILE_WIDTH);
+	return x + y * FRAME_TILES_X;
+}
+
+// metatile index width, flags included
+static size_t meta_bits(const metatiles_t* metatiles)
+{
+	size_t count = buffer_count(&(metatiles->buffer));
+	size_t bits = 1;
+	while (((size_t)1 << bits) < count)
+		++bits;
+	return bits + 3;
+}
+
+/*
+    pick the cells of curr that are coded as metatiles and mark their positions in filled.
+    returns 0 if there are none
+*/
+static int frame_meta(metatile_index_t* cells, uint8_t* filled, const frame_t* last, const frame_t* curr, const metatiles_t* metatiles)
+{
+	int any = 0;
+	memset(filled, 0, FRAME_TILE_COUNT);
+
+	for (size_t c = 0; c < FRAME_META_COUNT; ++c)
+	{
+		tile_index_t indices[METATILE_INDEX_COUNT];
+		size_t changed = 0;
+		for (size_t i = 0; i < METATILE_INDEX_COUNT; ++i)
+		{
+			size_t p = meta_position(c, i);
+			indices[i] = curr->tiles[p];
+			changed += curr->tiles[p] != last->tiles[p];
+		}
+
+		cells[c] = changed >= FRAME_META_MIN_CHANGED ? metatiles_match(metatiles, indices) : NO_METATILE;
+		if (cells[c] == NO_METATILE)
+			continue;
+
+		for (size_t i = 0; i < METATILE_INDEX_COUNT; ++i)
+			filled[meta_position(c, i)] = 1;
+		any = 1;
+	}
+
+	return any;
+}
+
+static void write_meta(bits_t* fbits, const metatile_index_t* cells, const metatiles_t* metatiles)
+{
+	size_t bits = meta_bits(metatiles);
+	for (size_t c = 0; c < FRAME_META_COUNT;)
+	{
+		int meta = cells[c] != NO_METATILE;
+		size_t length = 1;
+		while ((c + length) < FRAME_META_COUNT && length < FRAME_META_MAX_LENGTH && (cells[c + length] != NO_METATILE) == meta)
+			++length;
+
+		bits_write(fbits, (meta ? FRAME_META_RUN : 0) | (length - 1), 8);
+		for (size_t k = c; meta && k < c + length; ++k)
+		{
+			bits_write(fbits, cells[k] >> TILE_FLAGS_SHIFT, 3);
+			bits_write(fbits, cells[k] & ~TILE_BITS_MASK, bits - 3);
+		}
+
+		c += length;
+	}
+}
+
+// fills in the metatile cells of frame and marks them, the rest is left to the tile runs
+// -1 for a metatile past the dictionary
+static int read_meta(bits_t* fbits, const metatiles_t* metatiles, frame_t* frame, uint8_t* filled)
+{
+	size_t bits = meta_bits(metatiles);
+	for (size_t c = 0; c < FRAME_META_COUNT;)
+	{
+		uint8_t header = bits_read(fbits, 8);
+		size_t length = (header & (FRAME_META_MAX_LENGTH - 1)) + 1;
+		length = (c + length) > FRAME_META_COUNT ? FRAME_META_COUNT - c : length;
+
+		for (size_t k = c; (header & FRAME_META_RUN) && k < c + length; ++k)
+		{
+			metatile_index_t index = bits_read(fbits, 3) << TILE_FLAGS_SHIFT;
+			index |= bits_read(fbits, bits - 3);
+			if ((index & ~TILE_BITS_MASK) >= buffer_count(&(metatiles->buffer)))
+				return -1;
+
+			metatile_t metatile = metatiles_get(metatiles, index);
+			for (size_t i = 0; i < METATILE_INDEX_COUNT; ++i)
+			{
+				frame->tiles[meta_position(k, i)] = metatile.indices[i];
+				filled[meta_position(k, i)] = 1;
+			}
+		}
+
+		c += length;
+	}
+
+	return 0;
+}
+
+// longest non-literal run at order[start], ties go to the cheapest op
+static size_t best_op(size_t start, const uint16_t* order, size_t count, size_t max_length, size_t candidates, uint8_t motion, const frame_t* last, const frame_t* curr, uint8_t* op)
+{
+	size_t best_length = 0;
+
+	for (size_t i = 0; i < candidates; ++i)
+	{
+		uint8_t candidate = frame_op_candidates[i];
+		if (candidate == FRAME_OP_COPY && motion == NO_MOTION)
+			continue;
+
+		size_t length = 0;
+		for (size_t k = start; k < count && length < max_length; ++k, ++length)
+		{
+			tile_index_t source;
+			if (!op_source(candidate, order[k], order[start], motion, last, curr, &source) || source != curr->tiles[order[k]])
+				break;
+		}
+
+		if (length > best_length)
+		{
+			best_length = length;
+			*op = candidate;
+		}
+	}
+
+	return best_length;
+}
+
+/*
+    with STREAM_FLAG_FRAME_PATCH the tiles from index stored on are not saved, the decoder appends each one
+    when its patch comes along. so a position is a patch exactly when it shows the next of those tiles, unflipped
+*/
+static int frame_patches(uint8_t* patches, const frame_t* curr, size_t* next)
+{
+	int any = 0;
+	for (size_t p = 0; p < FRAME_TILE_COUNT; ++p)
+	{
+		patches[p] = curr->tiles[p] == *next;
+		if (patches[p])
+		{
+			++(*next);
+			any = 1;
+		}
+	}
+	return any;
+}
+
+// split the open positions of a frame into runs, only skip and literal runs without STREAM_FLAG_FRAME_OPS, patches is optional
+static size_t frame_split(frame_run_t* runs, const frame_t* last, const frame_t* curr, uint32_t flags, const uint8_t* patches, const uint16_t* order, size_t positions)
+{
+	int ops = (flags & STREAM_FLAG_FRAME_OPS) != 0;
+	size_t max_length = ops ? FRAME_OP_MAX_LENGTH : FRAME_RUN_MAX_LENGTH;
+	size_t candidates = ops ? sizeof(frame_op_candidates) : 1;
+	uint8_t motion = ops ? frame_motion(last, curr) : NO_MOTION;
+
+	// with ops a single matching tile is not worth breaking a literal run for
+	size_t min_break = ops ? 2 : 1;
+
+	size_t count = 0;
+	for (size_t j = 0; j < positions;)
+	{
+		frame_run_t* run = &runs[count++];
+		run->op = FRAME_OP_LITERAL;
+		run->motion = motion;
+		run->start = j;
+		run->length = best_op(j, order, positions, max_length, candidates, motion, last, curr, &(run->op));
+
+		if (run->length == 0 && patches && patches[order[j]])
+		{
+			run->op = FRAME_OP_PATCH;
+			while ((j + run->length) < positions && run->length < max_length && patches[order[j + run->length]])
+				run->length++;
+		}
+		else if (run->length == 0)
+		{
+			size_t length = 1;
+			for (; (j + length) < positions && length < max_length && !(patches && patches[order[j + length]]); ++length)
+			{
+				uint8_t op;
+				if (best_op(j + length, order, positions, min_break, candidates, motion, last, curr, &op) >= min_break)
+					break;
+			}
+			run->length = length;
+		}
+
+		j += run->length;
+	}
+
+	return count;
+}
+
+static uint8_t run_header(const frame_run_t* run, uint32_t flags)
+{
+	if (flags & STREAM_FLAG_FRAME_OPS)
+		return (run->op << FRAME_OP_SHIFT) | (run->length - 1);
+	return (run->op == FRAME_OP_SKIP ? FRAME_RUN_SKIP : 0) | (run->length - 1);
+}
+
+static void parse_header(uint8_t header, uint32_t flags, uint8_t* op, size_t* length)
+{
+	if (flags & STREAM_FLAG_FRAME_OPS)
+	{
+		*op = header >> FRAME_OP_SHIFT;
+		*length = (header & (FRAME_OP_MAX_LENGTH - 1)) + 1;
+	}
+	else
+	{
+		*op = (header & FRAME_RUN_SKIP) ? FRAME_OP_SKIP : FRAME_OP_LITERAL;
+		*length = (header & (FRAME_RUN_MAX_LENGTH - 1)) + 1;
+	}
+}
+
+static uint32_t hash_frame(const frame_t* frame)
+{
+	uint32_t hash = 2166136261U;
+	for (size_t i = 0; i < FRAME_TILE_COUNT; ++i)
+		hash = (hash ^ frame->tiles[i]) * 16777619U;
+	return hash;
+}
+
+// tile uploads ahead of maps first to last into none of the slots map shows
+static int slots_kept(const cache_t* cache, const frame_t* map, size_t first, size_t last)
+{
+	for (size_t m = first; m <= last; ++m)
+	{
+		const cache_range_t* range = cache_range(cache, m);
+		for (size_t i = range->first_tile, e = i + range->tiles; i < e; ++i)
+		{
+			const cache_tile_upload_t* upload = buffer_get(&(cache->tiles), i);
+			for (size_t p = 0; p < FRAME_TILE_COUNT; ++p)
+			{
+				if ((map->tiles[p] & ~TILE_BITS_MASK) == upload->slot)
+					return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+/*
+    decide per frame whether it is stored as a map, held with a repeat record or taken from an earlier
+    map with a reference record. the history holds the frame indices of stored maps, newest at head - 1
+*/
+static void frame_plan(uint16_t* plan, const frames_t* frames, const cache_t* cache, uint32_t flags)
+{
+	size_t n = buffer_count(&(frames->buffer));
+	memset(plan, 0, sizeof(uint16_t) * n);
+
+	if (!(flags & STREAM_FLAG_FRAME_REPEAT))
+		return;
+
+	uint32_t history[FRAME_HISTORY];
+	uint32_t hashes[FRAME_HISTORY];
+	size_t head = 0, stored = 0;
+	size_t repeat = n; // frame with the open repeat record, n for none
+
+	for (size_t i = 0; i < n; ++i)
+	{
+		const frame_t* curr = buffer_get(&(frames->buffer), i);
+
+		/*
+		    cache maps can keep their slots while what is in them changes. a repeat record has no room for
+		    uploads, and the other planes' maps since the one a frame back must not have uploaded into its slots
+		*/
+		const cache_range_t* range = cache ? cache_range(cache, i) : NULL;
+		int uploads = range && (range->blocks || range->tiles);
+		int kept = !uploads && i >= frames->planes && (!cache || slots_kept(cache, curr, i - frames->planes + 1, i - 1));
+
+		if (kept && !memcmp(curr, frames_last(frames, i), sizeof(frame_t)))
+		{
+			if (repeat < n && (plan[repeat] & FRAME_HEADER_ARG_MASK) < FRAME_HEADER_ARG_MASK)
+			{
+				plan[repeat]++;
+				plan[i] = FRAME_PLAN_COVERED;
+			}
+			else
+			{
+				repeat = i;
+				plan[i] = FRAME_HEADER_REPEAT;
+			}
+			continue;
+		}
+
+		repeat = n;
+		if (cache)
+			continue;
+
+		uint32_t hash = hash_frame(curr);
+
+		size_t back = 0;
+		for (size_t d = 1; d <= stored && !back; ++d)
+		{
+			size_t slot = (head + FRAME_HISTORY - d) % FRAME_HISTORY;
+			if (hashes[slot] == hash && !memcmp(curr, buffer_get(&(frames->buffer), history[slot]), sizeof(frame_t)))
+				back = d;
+		}
+
+		if (back)
+		{
+			plan[i] = FRAME_HEADER_REF | (back - 1);
+			continue;
+		}
+
+		history[head] = i;
+		hashes[head] = hash;
+		head = (head + 1) % FRAME_HISTORY;
+		stored = stored < FRAME_HISTORY ? stored + 1 : stored;
+	}
+}
+
+// uploads ahead of a cache map, blocks as their bits and tiles as block slots
+static void write_uploads(bits_t* fbits, const cache_t* cache, size_t map, const tiles_t* tiles, size_t tile_bits, size_t block_bits)
+{
+	const cache_range_t* range = cache_range(cache, map);
+
+	// a map shows FRAME_TILE_COUNT tiles of TILE_INDEX_COUNT blocks, it never needs more uploads than that
+	assert(range->blocks < (1 << FRAME_UPLOAD_COUNT_BITS) && range->tiles < (1 << FRAME_UPLOAD_COUNT_BITS));
+
+	bits_write(fbits, range->blocks, FRAME_UPLOAD_COUNT_BITS);
+	for (size_t i = range->first_block, e = i + range->blocks; i < e; ++i)
+	{
+		const cache_block_upload_t* upload = buffer_get(&(cache->blocks), i);
+		const block_t* block = buffer_get(&(tiles->blocks.buffer), upload->index);
+
+		bits_write(fbits, upload->slot, block_bits - 3);
+		for (size_t k = 0; k < sizeof(block->bits); ++k)
+			bits_write(fbits, block->bits[k], 8);
+	}
+
+	bits_write(fbits, range->tiles, FRAME_UPLOAD_COUNT_BITS);
+	for (size_t i = range->first_tile, e = i + range->tiles; i < e; ++i)
+	{
+		const cache_tile_upload_t* upload = buffer_get(&(cache->tiles), i);
+
+		bits_write(fbits, upload->slot, tile_bits - 3);
+		for (size_t k = 0; k < TILE_INDEX_COUNT; ++k)
+		{
+			bits_write(fbits, upload->indices[k] >> TILE_FLAGS_SHIFT, 3);
+			bits_write(fbits, upload->indices[k] & ~BLOCK_BITS_MASK, block_bits - 3);
+		}
+	}
+}
+
+/*
+    uploads go straight into the slots, tiles has as many entries as there are slots. what was in a slot
+    is gone, a map decoded before only draws right until the next frame is decoded. -1 for a slot that is
+    not there
+*/
+static int read_uploads(bits_t* fbits, tiles_t* tiles, uint32_t* uploaded, size_t map, size_t tile_bits, size_t block_bits)
+{
+	size_t tile_count = buffer_count(&(tiles->buffer)), block_count = buffer_count(&(tiles->blocks.buffer));
+
+	for (size_t i = 0, n = bits_read(fbits, FRAME_UPLOAD_COUNT_BITS); i < n; ++i)
+	{
+		size_t slot = bits_read(fbits, block_bits - 3);
+		if (slot >= block_count)
+			return -1;
+
+		block_t* block = buffer_get(&(tiles->blocks.buffer), slot);
+		for (size_t k = 0; k < sizeof(block->bits); ++k)
+			block->bits[k] = bits_read(fbits, 8);
+	}
+
+	for (size_t i = 0, n = bits_read(fbits, FRAME_UPLOAD_COUNT_BITS); i < n; ++i)
+	{
+		size_t slot = bits_read(fbits, tile_bits - 3);
+		if (slot >= tile_count)
+			return -1;
+
+		tile_t* tile = buffer_get(&(tiles->buffer), slot);
+		for (size_t k = 0; k < TILE_INDEX_COUNT; ++k)
+		{
+			block_index_t flags = bits_read(fbits, 3) << TILE_FLAGS_SHIFT;
+			block_index_t index = bits_read(fbits, block_bits - 3);
+			if (index >= block_count)
+				return -1;
+			tile->indices[k] = index | flags;
+		}
+		uploaded[slot] = map + 1;
+	}
+
+	return 0;
+}
+
+int frames_decoder_init(frames_decoder_t* decoder, const buffer_t* in, size_t offset, size_t count, size_t planes, tiles_t* tiles, const metatiles_t* metatiles, size_t tile_bits, size_t block_bits, uint32_t flags)
+{
+    if (flags & STREAM_FLAG_HUFFMAN_FRAMES)
+    {
+        // tables that did not load stay empty, so releasing all three is fine
+        memset(&(decoder->coder), 0, sizeof(decoder->coder));
+        long next = huffman_load(in, offset, &(decoder->coder.runs));
+        if (next >= 0)
+            next = huffman_load(in, next, &(decoder->coder.tiles));
+        if (next >= 0)
+            next = huffman_load(in, next, &(decoder->coder.flags));
+
+        if (next < 0)
+        {
+            fprintf(stderr, "Huffman tables do not fit the frames section\n");
+            frame_coder_release(&(decoder->coder));
+            return -1;
+        }
+        offset = next;
+    }
+
+    decoder->in = in;
+    decoder->start = offset;
+    decoder->count = count;
+    decoder->planes = planes;
+
+    decoder->tiles = tiles;
+    decoder->metatiles = metatiles;
+    decoder->tile_bits = tile_bits;
+    decoder->block_bits = block_bits;
+    decoder->flags = flags;
+
+    decoder->base_tiles = buffer_count(&(tiles->buffer));
+    decoder->base_blocks = buffer_count(&(tiles->blocks.buffer));
+
+    decoder->history = (flags & STREAM_FLAG_FRAME_REPEAT) ? malloc(sizeof(frame_t) * FRAME_HISTORY) : NULL;
+
+    decoder->uploaded = (flags & STREAM_FLAG_TILE_CACHE) ? malloc(sizeof(uint32_t) * buffer_count(&(tiles->buffer))) : NULL;
+
+    frames_decoder_rewind(decoder);
+    return 0;
+}
+
+void frames_decoder_release(frames_decoder_t* decoder)
+{
+    free(decoder->uploaded);
+    free(decoder->history);
+
+    if (decoder->flags & STREAM_FLAG_HUFFMAN_FRAMES)
+        frame_coder_release(&(decoder->coder));
+}
+
+void frames_decoder_rewind(frames_decoder_t* decoder)
+{
+    decoder->offset = decoder->start;
+    decoder->index = 0;
+    decoder->head = 0;
+    decoder->stored = 0;
+    decoder->repeats = 0;
+
+    tiles_truncate(decoder->tiles, decoder->base_tiles, decoder->base_blocks);
+    memset(decoder->last, 0xff, sizeof(decoder->last));
+
+    // the slots keep what they had, the maps upload everything again before they show it
+    if (decoder->uploaded)
+        memset(decoder->uploaded, 0, sizeof(uint32_t) * buffer_count(&(decoder->tiles->buffer)));
+}
+
+// a map that does not decode ends the maps until the next rewind
+static int corrupt_map(frames_decoder_t* decoder)
 {
-    frame_t last;
-    memset(&last, 0xff, sizeof(last));
+    fprintf(stderr, "Frame map %lu is corrupt\n", decoder->index);
+    decoder->index = decoder->count;
+    decoder->repeats = 0;
+    return -1;
+}
+
+int frames_decoder_next(frames_decoder_t* decoder, frame_t* frame)
+{
+    if (decoder->index >= decoder->count)
+        return -1;
+
+    const buffer_t* in = decoder->in;
+    tiles_t* tiles = decoder->tiles;
+    size_t tile_bits = decoder->tile_bits, block_bits = decoder->block_bits;
+    uint32_t flags = decoder->flags;
+    size_t plane = decoder->index % decoder->planes;
+    frame_t* last = &(decoder->last[plane]);
+
+    // held frames are the previous frame again, flagged so players can skip them
+    if (decoder->repeats)
+    {
+        --(decoder->repeats);
+        ++(decoder->index);
+        *frame = *last;
+        return 1;
+    }
 
-    for (size_t i = 0; i < count; ++i)
+    frame_header_t header;
+    if (buffer_count(in) - decoder->offset < sizeof(header))
+        return corrupt_map(decoder);
+    memcpy(&header, buffer_get(in, decoder->offset), sizeof(header));
+    decoder->offset += sizeof(header);
+
+    header.size = u16be(header.size);
+
+    if ((flags & STREAM_FLAG_FRAME_REPEAT) && (header.size & FRAME_HEADER_REPEAT))
     {
-        frame_t* frame = buffer_alloc(&(frames->buffer), 1);
+        size_t repeats = (header.size & FRAME_HEADER_ARG_MASK) + 1;
+        decoder->repeats = repeats > decoder->count - decoder->index ? decoder->count - decoder->index : repeats;
+        return frames_decoder_next(decoder, frame);
+    }
+
+    ++(decoder->index);
+
+    if ((flags & STREAM_FLAG_FRAME_REPEAT) && (header.size & FRAME_HEADER_REF))
+    {
+        size_t back = (header.size & FRAME_HEADER_ARG_MASK) + 1;
+        if (back > decoder->stored)
+            return corrupt_map(decoder);
+        *frame = decoder->history[(decoder->head + FRAME_HISTORY - back) % FRAME_HISTORY];
+        *last = *frame;
+        return 0;
+    }
 
-        frame_header_t header;
-        memcpy(&header, buffer_get(in, offset), sizeof(header));
-        offset += sizeof(header);
+    if (buffer_count(in) - decoder->offset < header.size)
+        return corrupt_map(decoder);
 
-        header.size = u16be(header.size);
+    bits_t fbits;
+    bits_init_read(&fbits, buffer_get(in, decoder->offset), header.size);
+    decoder->offset += header.size;
 
-        bits_t fbits;
-        bits_init_read(&fbits, buffer_get(in, offset), header.size);
-        offset += header.size;
+    if ((flags & STREAM_FLAG_TILE_CACHE) && read_uploads(&fbits, tiles, decoder->uploaded, decoder->index - 1, tile_bits, block_bits) < 0)
+        return corrupt_map(decoder);
 
-        fprintf(stderr, "Loading frame %ld, %d bytes (%d bits per tile index)\n", i, header.size, tile_bits);
+    uint8_t filled[FRAME_TILE_COUNT];
+    memset(filled, 0, sizeof(filled));
+    if ((flags & STREAM_FLAG_METATILES) && bits_read(&fbits, 1) && read_meta(&fbits, decoder->metatiles, frame, filled) < 0)
+        return corrupt_map(decoder);
 
-        for (size_t j = 0; j < FRAME_TILE_COUNT;)
+    uint16_t order[FRAME_TILE_COUNT];
+    size_t positions = frame_order(order, filled);
+
+    for (size_t j = 0; j < positions;)
+    {
+        uint8_t header = (flags & STREAM_FLAG_HUFFMAN_FRAMES) ? huffman_read(&fbits, &(decoder->coder.runs)) : bits_read(&fbits, 8);
+
+        uint8_t op;
+        size_t length;
+        parse_header(header, flags, &op, &length);
+        length = (j + length) > positions ? positions - j : length;
+
+        if (op == FRAME_OP_SKIP)
+        {
+            for (size_t k = j; k < j + length; ++k)
+                frame->tiles[order[k]] = last->tiles[order[k]];
+        }
+        else if (op == FRAME_OP_PATCH)
+        {
+            for (size_t k = j; k < j + length; ++k)
+            {
+                if ((last->tiles[order[k]] & ~TILE_BITS_MASK) >= buffer_count(&(tiles->buffer)))
+                    return corrupt_map(decoder);
+                tile_t tile = tiles_get(tiles, last->tiles[order[k]]);
+
+                size_t slot = bits_read(&fbits, 2);
+                block_index_t index = bits_read(&fbits, 3) << TILE_FLAGS_SHIFT;
+                index |= bits_read(&fbits, block_bits - 3);
+                if ((index & ~BLOCK_BITS_MASK) >= buffer_count(&(tiles->blocks.buffer)))
+                    return corrupt_map(decoder);
+
+                tile.indices[slot] = index;
+                frame->tiles[order[k]] = tiles_add(tiles, &tile);
+            }
+        }
+        else if (op != FRAME_OP_LITERAL)
+        {
+            uint8_t motion = (op == FRAME_OP_COPY) ? bits_read(&fbits, 8) : NO_MOTION;
+            for (size_t k = j; k < j + length; ++k)
+            {
+                if (!op_source(op, order[k], order[j], motion, last, frame, &(frame->tiles[order[k]])))
+                    frame->tiles[order[k]] = last->tiles[order[k]];
+            }
+        }
+        else if (flags & STREAM_FLAG_HUFFMAN_FRAMES)
         {
-            uint8_t header = bits_read(&fbits, 8);
-            uint8_t length = (header & 0x7f) + 1;
-            if (header & 0x80)
+            for (size_t k = 0; k < length; ++k)
             {
-                memcpy(&(frame->tiles[j]), &(last.tiles[j]), length * sizeof(tile_index_t));
+                tile_index_t index = huffman_read(&fbits, &(decoder->coder.tiles));
+                frame->tiles[order[j + k]] = index | (huffman_read(&fbits, &(decoder->coder.flags)) << TILE_FLAGS_SHIFT);
             }
-            else
+        }
+        else
+        {
+            for (size_t k = 0; k < length; ++k)
             {
-                for (size_t k = 0; k < length; ++k)
-                {
-                    frame->tiles[j + k] = ti_uncompress(bits_read(&fbits, tile_bits), tile_bits);
-                }
+                frame->tiles[order[j + k]] = ti_uncompress(bits_read(&fbits, tile_bits), tile_bits);
             }
+        }
+
+        j += length;
+    }
+
+    if (bits_overrun(&fbits))
+        return corrupt_map(decoder);
+
+    // whatever the runs said, renderers only get tiles that are there
+    for (size_t p = 0; p < FRAME_TILE_COUNT; ++p)
+    {
+        if ((frame->tiles[p] & ~TILE_BITS_MASK) >= buffer_count(&(tiles->buffer)))
+            return corrupt_map(decoder);
+    }
+
+    decoder->last[plane] = *frame;
+    if (decoder->history)
+    {
+        decoder->history[decoder->head] = *frame;
+        decoder->head = (decoder->head + 1) % FRAME_HISTORY;
+        decoder->stored = decoder->stored < FRAME_HISTORY ? decoder->stored + 1 : FRAME_HISTORY;
+    }
+
+    return 0;
+}
+
+// what a slot shows, found or added in tiles
+static tile_index_t slot_tile(tiles_t* tiles, const tiles_t* slots, tile_index_t slot)
+{
+    tile_t tile = tiles_get(slots, slot);
+    for (size_t k = 0; k < TILE_INDEX_COUNT; ++k)
+    {
+        const block_t* block = buffer_get(&(slots->blocks.buffer), tile.indices[k] & ~BLOCK_BITS_MASK);
+        block_index_t found = blocks_find(&(tiles->blocks), block);
+        found = found != NO_BLOCK ? found : blocks_add(&(tiles->blocks), block);
+        tile.indices[k] = found | (tile.indices[k] & BLOCK_BITS_MASK);
+    }
+
+    tile_index_t found = tiles_find(tiles, &tile);
+    return found != NO_TILE ? found : tiles_add(tiles, &tile);
+}
+
+/*
+    every map of the clip at once. cache maps only hold while their slots do, so they are decoded against
+    the slots tiles came with and what they show is found or added in a whole dictionary, as the encoder had it.
+    found keeps that per slot until the slot takes an upload
+*/
+long frames_load(const buffer_t* in, size_t offset, size_t count, frames_t* frames, tiles_t* tiles, const metatiles_t* metatiles, size_t tile_bits, size_t block_bits, uint32_t flags)
+{
+    tiles_t slots;
+    tiles_t* decoded = tiles;
+    if (flags & STREAM_FLAG_TILE_CACHE)
+    {
+        slots = *tiles;
+        decoded = &slots;
+
+        tiles_init(tiles);
+        if (slots.blocks.solid)
+            tiles_reserve_solid(tiles);
+    }
+
+    frames_decoder_t decoder;
+    if (frames_decoder_init(&decoder, in, offset, count, frames->planes, decoded, metatiles, tile_bits, block_bits, flags) < 0)
+    {
+        if (decoded != tiles)
+            tiles_release(&slots);
+        return -1;
+    }
+
+    buffer_reserve(&(frames->buffer), count);
+    buffer_reserve(&(frames->held), count);
+
+    size_t slot_count = buffer_count(&(decoded->buffer));
+    tile_index_t* found = decoded != tiles ? malloc(sizeof(tile_index_t) * slot_count) : NULL;
+    if (found)
+        memset(found, 0xff, sizeof(tile_index_t) * slot_count);
+
+    frame_t frame;
+    int held;
+    while ((held = frames_decoder_next(&decoder, &frame)) >= 0)
+    {
+        for (size_t s = 0; s < slot_count && found; ++s)
+        {
+            if (decoder.uploaded[s] == decoder.index)
+                found[s] = NO_TILE;
+        }
 
-            j += length;
+        for (size_t p = 0; p < FRAME_TILE_COUNT && found; ++p)
+        {
+            tile_index_t slot = frame.tiles[p] & ~TILE_BITS_MASK;
+            if (found[slot] == NO_TILE)
+                found[slot] = slot_tile(tiles, &slots, slot);
+            frame.tiles[p] = found[slot] | (frame.tiles[p] & TILE_BITS_MASK);
         }
 
-        last = *frame;
+        frames_add(frames, &frame);
+        *(uint8_t*)buffer_get(&(frames->held), buffer_count(&(frames->held)) - 1) = held;
+    }
+
+    offset = decoder.offset;
+    frames_decoder_release(&decoder);
+    if (found)
+    {
+        free(found);
+        tiles_release(&slots);
     }
 
     return offset;
 }
 
-void frames_save(buffer_t* out, const frames_t* frames, size_t tile_bits)
+static void frame_coder_build(frame_coder_t* coder, const frames_t* frames, const metatiles_t* metatiles, const uint16_t* plan, size_t stored, uint32_t flags)
 {
-	frame_t last;
-	memset(&last, 0xff, sizeof(last));
+	size_t tile_symbols = 0;
+	for (size_t i = 0, n = buffer_count(&(frames->buffer)); i < n; ++i)
+	{
+		const frame_t* curr = buffer_get(&(frames->buffer), i);
+		for (size_t j = 0; j < FRAME_TILE_COUNT; ++j)
+		{
+			size_t index = curr->tiles[j] & ~TILE_BITS_MASK;
+			tile_symbols = index >= tile_symbols ? index + 1 : tile_symbols;
+		}
+	}
 
-	bits_t fbits;
-	bits_init_write(&fbits);
+	uint32_t* run_freqs = calloc(256, sizeof(uint32_t));
+	uint32_t* tile_freqs = calloc(tile_symbols + 1, sizeof(uint32_t));
+	uint32_t* flag_freqs = calloc(8, sizeof(uint32_t));
+
+	uint8_t patches[FRAME_TILE_COUNT];
+	size_t next = stored;
+
+	metatile_index_t cells[FRAME_META_COUNT];
+	uint8_t filled[FRAME_TILE_COUNT];
+	uint16_t order[FRAME_TILE_COUNT];
 
+	frame_run_t runs[FRAME_TILE_COUNT];
 	for (size_t i = 0, n = buffer_count(&(frames->buffer)); i < n; ++i)
 	{
-		bits_reset(&fbits);
+		if (plan[i] != FRAME_PLAN_MAP)
+			continue;
+
 		const frame_t* curr = buffer_get(&(frames->buffer), i);
+		const frame_t* last = frames_last(frames, i);
 
-		const tile_index_t* li = last.tiles;
-		const tile_index_t* ci = curr->tiles;
-		const tile_index_t* first = NULL;
-		int skipping = 0;
+		int patched = PATCHING(flags) && frame_patches(patches, curr, &next);
+		int meta = (flags & STREAM_FLAG_METATILES) && frame_meta(cells, filled, last, curr, metatiles);
+		size_t positions = frame_order(order, meta ? filled : NULL);
 
-		for (size_t i = 0; i < (FRAME_WIDTH / TILE_WIDTH) * (FRAME_HEIGHT / TILE_HEIGHT); ++i, ++li, ++ci)
+		for (size_t j = 0, m = frame_split(runs, last, curr, flags, patched ? patches : NULL, order, positions); j < m; ++j)
 		{
-			if (first && (ci - first) == 128)
-			{
-			    uint8_t length = ((uint8_t)(ci - first))-1;
-				if (skipping)
-				{
-					bits_write(&fbits, length|0x80, 8);
-				}
-				else
-				{
-					bits_write(&fbits, length, 8);
-					for (; first < ci; ++first)
-						bits_write(&fbits, ti_compress(*first, tile_bits), tile_bits);
-				}
-				first = NULL; skipping = 0;
-			}
+			run_freqs[run_header(&runs[j], flags)]++;
+			if (runs[j].op != FRAME_OP_LITERAL)
+				continue;
 
-			if (!first)
-			{
-				first = ci;
-				skipping = (*ci == *li) ? 1 : 0;
-			}
-			else
+			for (size_t k = runs[j].start, end = k + runs[j].length; k < end; ++k)
 			{
-			    uint8_t length = ((uint8_t)(ci - first))-1;
-				if (skipping && (*ci != *li))
-				{
-					bits_write(&fbits, length|0x80, 8);
-					first = ci; skipping = 0;
-				}
-				else if (!skipping && (*ci == *li))
-				{
-					bits_write(&fbits, length, 8);
-					for (; first < ci; ++first)
-						bits_write(&fbits, ti_compress(*first, tile_bits), tile_bits);
-					first = ci; skipping = 1;
-				}
+				tile_index_t index = curr->tiles[order[k]];
+				tile_freqs[index & ~TILE_BITS_MASK]++;
+				flag_freqs[index >> TILE_FLAGS_SHIFT]++;
 			}
 		}
+	}
+
+	huffman_init(&(coder->runs), 256);
+	huffman_build(&(coder->runs), run_freqs);
+	huffman_init(&(coder->tiles), tile_symbols);
+	huffman_build(&(coder->tiles), tile_freqs);
+	huffman_init(&(coder->flags), 8);
+	huffman_build(&(coder->flags), flag_freqs);
+
+	free(flag_freqs);
+	free(tile_freqs);
+	free(run_freqs);
+}
+
+static void write_patch(bits_t* fbits, const tiles_t* tiles, tile_index_t shown, tile_index_t patched, size_t block_bits)
+{
+	int slot = tiles_patch_slot(tiles, shown, patched);
+	block_index_t index = ((const tile_t*)buffer_get(&(tiles->buffer), patched))->indices[slot];
+
+	bits_write(fbits, slot, 2);
+	bits_write(fbits, index >> TILE_FLAGS_SHIFT, 3);
+	bits_write(fbits, index & ~BLOCK_BITS_MASK, block_bits - 3);
+}
+
+static void write_run(bits_t* fbits, const frame_coder_t* coder, const frame_run_t* run, const uint16_t* order, const tiles_t* tiles, const frame_t* last, const frame_t* curr, size_t tile_bits, size_t block_bits, uint32_t flags)
+{
+	uint8_t header = run_header(run, flags);
+
+	if (flags & STREAM_FLAG_HUFFMAN_FRAMES)
+		huffman_write(fbits, &(coder->runs), header);
+	else
+		bits_write(fbits, header, 8);
+
+	if (run->op == FRAME_OP_COPY)
+		bits_write(fbits, run->motion, 8);
+
+	if (run->op == FRAME_OP_PATCH)
+	{
+		for (size_t k = run->start, e = k + run->length; k < e; ++k)
+			write_patch(fbits, tiles, last->tiles[order[k]], curr->tiles[order[k]], block_bits);
+		return;
+	}
 
-		if (first)
+	if (run->op != FRAME_OP_LITERAL)
+		return;
+
+	for (size_t k = run->start, e = k + run->length; k < e; ++k)
+	{
+		tile_index_t index = curr->tiles[order[k]];
+		if (flags & STREAM_FLAG_HUFFMAN_FRAMES)
 		{
-            uint8_t length = ((uint8_t)(ci - first))-1;
-			if (skipping)
-			{
-				bits_write(&fbits, length|0x80, 8);
-			}
-			else
+			huffman_write(fbits, &(coder->tiles), index & ~TILE_BITS_MASK);
+			huffman_write(fbits, &(coder->flags), index >> TILE_FLAGS_SHIFT);
+		}
+		else
+		{
+			bits_write(fbits, ti_compress(index, tile_bits), tile_bits);
+		}
+	}
+}
+
+int frames_save(buffer_t* out, const frames_t* frames, const tiles_t* tiles, const metatiles_t* metatiles, const cache_t* cache, size_t stored, size_t tile_bits, size_t block_bits, uint32_t flags)
+{
+	uint16_t* plan = malloc(sizeof(uint16_t) * buffer_count(&(frames->buffer)));
+	frame_plan(plan, frames, cache, flags);
+
+	frame_coder_t coder;
+	if (flags & STREAM_FLAG_HUFFMAN_FRAMES)
+	{
+		frame_coder_build(&coder, frames, metatiles, plan, stored, flags);
+		huffman_save(out, &(coder.runs));
+		huffman_save(out, &(coder.tiles));
+		huffman_save(out, &(coder.flags));
+	}
+
+	bits_t fbits;
+	bits_init_write(&fbits);
+
+	size_t largest = 0;
+	size_t op_tiles[FRAME_OP_PATCH + 1] = { 0 };
+	size_t repeats = 0, held = 0, refs = 0;
+	size_t meta_cells = 0;
+	int ret = 0;
+
+	// with repeat records the top bits of the size are taken
+	size_t max_size = (flags & STREAM_FLAG_FRAME_REPEAT) ? FRAME_HEADER_ARG_MASK : 0xffff;
+
+	uint8_t patches[FRAME_TILE_COUNT];
+	size_t next = stored;
+
+	metatile_index_t cells[FRAME_META_COUNT];
+	uint8_t filled[FRAME_TILE_COUNT];
+	uint16_t order[FRAME_TILE_COUNT];
+
+	frame_run_t runs[FRAME_TILE_COUNT];
+	for (size_t i = 0, n = buffer_count(&(frames->buffer)); i < n; ++i)
+	{
+		bits_reset(&fbits);
+		const frame_t* curr = buffer_get(&(frames->buffer), i);
+		const frame_t* last = frames_last(frames, i);
+
+		if (plan[i] != FRAME_PLAN_MAP)
+		{
+			if (plan[i] != FRAME_PLAN_COVERED)
 			{
-				bits_write(&fbits, length, 8);
-				for (; first < ci; ++first)
-					bits_write(&fbits, ti_compress(*first, tile_bits), tile_bits);
+				frame_header_t fheader;
+				fheader.size = u16be(plan[i]);
+				buffer_add(out, &fheader, sizeof(frame_header_t));
+
+				repeats += (plan[i] & FRAME_HEADER_REPEAT) != 0;
+				refs += (plan[i] & FRAME_HEADER_REF) != 0;
 			}
+			held += plan[i] == FRAME_PLAN_COVERED || (plan[i] & FRAME_HEADER_REPEAT);
+			continue;
+		}
+
+		if (cache)
+			write_uploads(&fbits, cache, i, tiles, tile_bits, block_bits);
+
+		int patched = PATCHING(flags) && frame_patches(patches, curr, &next);
+		int meta = (flags & STREAM_FLAG_METATILES) && frame_meta(cells, filled, last, curr, metatiles);
+
+		if (flags & STREAM_FLAG_METATILES)
+			bits_write(&fbits, meta, 1);
+		if (meta)
+		{
+			write_meta(&fbits, cells, metatiles);
+			for (size_t c = 0; c < FRAME_META_COUNT; ++c)
+				meta_cells += cells[c] != NO_METATILE;
+		}
+
+		size_t positions = frame_order(order, meta ? filled : NULL);
+		for (size_t j = 0, m = frame_split(runs, last, curr, flags, patched ? patches : NULL, order, positions); j < m; ++j)
+		{
+			write_run(&fbits, &coder, &runs[j], order, tiles, last, curr, tile_bits, block_bits, flags);
+			op_tiles[runs[j].op] += runs[j].length;
 		}
 
 		bits_flush(&fbits);
 
+		// only uploads make a map this large
+		if (fbits.buf.size > max_size)
+		{
+			fprintf(stderr, "frame map %lu is %lu bytes, a frame header holds %lu\n", i, fbits.buf.size, max_size);
+			ret = -1;
+			break;
+		}
+
 		frame_header_t fheader;
 		fheader.size = u16be(fbits.buf.size);
 
 		buffer_add(out, &fheader, sizeof(frame_header_t));
 		buffer_add(out, fbits.buf.data, fbits.buf.size);
 
-		memcpy(&last, curr, sizeof(frame_t));
+		largest = fbits.buf.size > largest ? fbits.buf.size : largest;
 	}
 
 	bits_release(&fbits);
+
+	if (flags & STREAM_FLAG_HUFFMAN_FRAMES)
+		frame_coder_release(&coder);
+
+	if (ret < 0)
+	{
+		free(plan);
+		return -1;
+	}
+
+	fprintf(stderr, "frame maps: largest frame %lu bytes, tiles by op: literal %lu, skip %lu, copy %lu, above %lu, left %lu\n",
+		largest, op_tiles[FRAME_OP_LITERAL], op_tiles[FRAME_OP_SKIP], op_tiles[FRAME_OP_COPY], op_tiles[FRAME_OP_ABOVE], op_tiles[FRAME_OP_LEFT]);
+
+	if (PATCHING(flags))
+		fprintf(stderr, "patches: %lu tiles rebuilt by the decoder, %lu stored\n", op_tiles[FRAME_OP_PATCH], stored);
+
+	if (flags & STREAM_FLAG_METATILES)
+		fprintf(stderr, "metatiles: %lu cells (%lu tiles) from %lu metatiles\n", meta_cells, meta_cells * METATILE_INDEX_COUNT, buffer_count(&(metatiles->buffer)));
+
+	if (flags & STREAM_FLAG_FRAME_REPEAT)
+		fprintf(stderr, "frame records: %lu repeats holding %lu frames, %lu references to earlier maps\n", repeats, held, refs);
+
+	free(plan);
+	return 0;
+}
+
+void frames_stats(frame_stats_t* out, const frame_t* last, const frame_t* curr, size_t tile_bits, uint32_t flags)
+{
+	frame_run_t runs[FRAME_TILE_COUNT];
+	size_t bits = 0;
+
+	memset(out, 0, sizeof(frame_stats_t));
+
+	// a held frame is a bare repeat record
+	if ((flags & STREAM_FLAG_FRAME_REPEAT) && !memcmp(last, curr, sizeof(frame_t)))
+		return;
+
+	uint16_t order[FRAME_TILE_COUNT];
+	size_t positions = frame_order(order, NULL);
+
+	for (size_t j = 0, m = frame_split(runs, last, curr, flags, NULL, order, positions); j < m; ++j)
+	{
+		bits += 8;
+		if (runs[j].op == FRAME_OP_COPY)
+			bits += 8;
+		else if (runs[j].op == FRAME_OP_LITERAL)
+			bits += runs[j].length * tile_bits;
+
+		++out->runs;
+		if (runs[j].op == FRAME_OP_LITERAL)
+			out->literals += runs[j].length;
+	}
+
+	// every position that differs from last gets redrawn, whichever op produced it
+	for (size_t j = 0; j < FRAME_TILE_COUNT; ++j)
+	{
+		if (curr->tiles[j] != last->tiles[j])
+			++out->changed;
+	}
+
+	out->bytes = (bits + 7) / 8;
+}
+
+size_t frames_estimate(const frame_t* last, const frame_t* curr, size_t tile_bits, uint32_t flags)
+{
+	frame_stats_t stats;
+	frames_stats(&stats, last, curr, tile_bits, flags);
+	return stats.bytes;
 }
 
 void frames_remap_tiles(frames_t* frames, const tile_index_t* remaps)
@@ -187,4 +1220,31 @@ void frames_remap_tiles(frames_t* frames, const tile_index_t* remaps)
             frame->tiles[j] = out;
         }
     }
-}
\ No newline at end of file
+}
+void frames_build_metatiles(const frames_t* frames, metatiles_t* metatiles, size_t stored, size_t min_uses)
+{
+	for (size_t i = 0, n = buffer_count(&(frames->buffer)); i < n; ++i)
+	{
+		const frame_t* curr = buffer_get(&(frames->buffer), i);
+		const frame_t* last = frames_last(frames, i);
+
+		for (size_t c = 0; c < FRAME_META_COUNT; ++c)
+		{
+			tile_index_t indices[METATILE_INDEX_COUNT];
+			size_t changed = 0, patched = 0;
+			for (size_t k = 0; k < METATILE_INDEX_COUNT; ++k)
+			{
+				size_t p = meta_position(c, k);
+				indices[k] = curr->tiles[p];
+				changed += curr->tiles[p] != last->tiles[p];
+				patched += (curr->tiles[p] & ~TILE_BITS_MASK) >= stored;
+			}
+
+			// patched tiles only exist once the decoder has built them
+			if (changed >= FRAME_META_MIN_CHANGED && !patched)
+				metatiles_insert(metatiles, indices);
+		}
+	}
+
+	metatiles_prune(metatiles, min_uses);
+}
@@ -4,6 +4,8 @@
 #include <stdio.h>
 
 #include "tiles.h"
+#include "metatiles.h"
+#include "huffman.h"
 
 #define FRAME_WIDTH (320)
 #define FRAME_HEIGHT (256)
@@ -13,22 +15,111 @@ typedef struct frame_header_t
 	uint16_t size;
 } frame_header_t;
 
-#define FRAME_TILE_COUNT ((FRAME_WIDTH / TILE_WIDTH) * (FRAME_HEIGHT / TILE_HEIGHT))
+#define FRAME_TILES_X (FRAME_WIDTH / TILE_WIDTH)
+#define FRAME_TILES_Y (FRAME_HEIGHT / TILE_HEIGHT)
+#define FRAME_TILE_COUNT (FRAME_TILES_X * FRAME_TILES_Y)
 typedef struct frame_t
 {
 	tile_index_t tiles[FRAME_TILE_COUNT];
 } frame_t;
 
+#define FRAME_MAX_PLANES (4)
+
+/*
+    with more than one bitplane the buffer holds a map per plane for every frame, plane k of frame i at
+    i * planes + k. all planes share the dictionary, each map is coded against its own plane one frame back
+*/
 typedef struct frames_t
 {
 	buffer_t buffer;
+	buffer_t held; // uint8_t per map, set when loaded from a repeat record
+	size_t planes;
+
+	frame_t empty; // what is there before the first frame, all NO_TILE
 } frames_t;
 
 void frames_init(frames_t* frames);
 void frames_release(frames_t* frames);
 
 void frames_add(frames_t* frames, const frame_t* frame);
+int frames_held(const frames_t* frames, size_t index);
+// map the one at index follows, the same plane one frame back
+const frame_t* frames_last(const frames_t* frames, size_t index);
 void frames_remap_tiles(frames_t* frames, const tile_index_t* remaps);
 
-size_t frames_load(const buffer_t* in, size_t offset, size_t count, frames_t* frames, size_t tile_bits);
-void frames_save(buffer_t* out, const frames_t* frames, size_t tile_bits);
+// with STREAM_FLAG_FRAME_PATCH tiles from index stored on are left out of the dictionary and appended by the loader
+struct cache_t;
+
+/*
+    with STREAM_FLAG_METATILES cells that match one of metatiles are coded as that metatile.
+    with STREAM_FLAG_TILE_CACHE frames are the cache maps, each map carries its uploads and the loader
+    adds the uploaded blocks and tiles to tiles unless they are there already, giving back maps of tile indices.
+    -1 when the maps do not load
+*/
+long frames_load(const buffer_t* in, size_t offset, size_t count, frames_t* frames, tiles_t* tiles, const metatiles_t* metatiles, size_t tile_bits, size_t block_bits, uint32_t flags);
+// entropy coder state for STREAM_FLAG_HUFFMAN_FRAMES
+typedef struct frame_coder_t
+{
+	huffman_t runs;
+	huffman_t tiles;
+	huffman_t flags;
+} frame_coder_t;
+
+/*
+    decodes the maps one at a time, keeping only the last map of every plane and the stored maps reference
+    records reach back to. patches are appended to tiles as they come, rewinding drops them again. with
+    STREAM_FLAG_TILE_CACHE tiles holds the slots and uploads overwrite them in place, the maps index the slots
+*/
+typedef struct frames_decoder_t
+{
+	const buffer_t* in;
+	size_t start; // first map record, after the entropy tables
+	size_t offset; // next map record
+	size_t count; // maps, planes for every frame
+	size_t index; // next map
+	size_t planes;
+
+	tiles_t* tiles;
+	const metatiles_t* metatiles;
+	size_t tile_bits;
+	size_t block_bits;
+	uint32_t flags;
+
+	size_t base_tiles; // dictionary before the first map appended to it
+	size_t base_blocks;
+
+	frame_coder_t coder;
+	frame_t last[FRAME_MAX_PLANES];
+	frame_t* history; // FRAME_REPEAT reference records
+	size_t head;
+	size_t stored; // maps in history so far
+	size_t repeats; // maps left of a repeat record
+
+	uint32_t* uploaded; // STREAM_FLAG_TILE_CACHE, per tile slot the map it was last uploaded with, + 1
+} frames_decoder_t;
+
+// -1 when the huffman tables of STREAM_FLAG_HUFFMAN_FRAMES do not fit in, nothing to release then
+int frames_decoder_init(frames_decoder_t* decoder, const buffer_t* in, size_t offset, size_t count, size_t planes, tiles_t* tiles, const metatiles_t* metatiles, size_t tile_bits, size_t block_bits, uint32_t flags);
+void frames_decoder_release(frames_decoder_t* decoder);
+// the next map into out, 1 when a repeat record holds the last one of its plane, 0 when decoded, -1 after the last or when it is corrupt
+int frames_decoder_next(frames_decoder_t* decoder, frame_t* out);
+void frames_decoder_rewind(frames_decoder_t* decoder);
+
+// -1 when a map, uploads and all, is too large for its frame header
+int frames_save(buffer_t* out, const frames_t* frames, const tiles_t* tiles, const metatiles_t* metatiles, const struct cache_t* cache, size_t stored, size_t tile_bits, size_t block_bits, uint32_t flags);
+
+// collect metatiles from the changing cells of frames, leaving out cells with tiles from stored on and keeping those used min_uses times
+void frames_build_metatiles(const frames_t* frames, metatiles_t* metatiles, size_t stored, size_t min_uses);
+
+typedef struct frame_stats_t
+{
+	size_t runs; // run headers
+	size_t literals; // tiles coded as literal indices
+	size_t changed; // positions that differ from last and get drawn
+	size_t bytes; // encoded size, literals counted at the fixed tile_bits width
+} frame_stats_t;
+
+void frames_stats(frame_stats_t* out, const frame_t* last, const frame_t* curr, size_t tile_bits, uint32_t flags);
+
+// encoded size of curr following last in bytes, with literals counted at the fixed tile_bits width
+size_t frames_estimate(const frame_t* last, const frame_t* curr, size_t tile_bits, uint32_t flags);
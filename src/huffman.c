@@ -0,0 +1,232 @@
+#include "huffman.h"
+#include "stream.h"
+
+#include <string.h>
+#include <assert.h>
+
+typedef struct huffman_leaf_t
+{
+	uint32_t freq;
+	uint32_t symbol;
+} huffman_leaf_t;
+
+void huffman_init(huffman_t* huffman, size_t symbols)
+{
+	huffman->symbols = symbols;
+	huffman->lengths = calloc(symbols ? symbols : 1, sizeof(uint8_t));
+	huffman->codes = calloc(symbols ? symbols : 1, sizeof(uint32_t));
+	huffman->sorted = calloc(symbols ? symbols : 1, sizeof(uint32_t));
+
+	memset(huffman->counts, 0, sizeof(huffman->counts));
+}
+
+void huffman_release(huffman_t* huffman)
+{
+	free(huffman->lengths);
+	free(huffman->codes);
+	free(huffman->sorted);
+
+	huffman->lengths = NULL;
+	huffman->codes = NULL;
+	huffman->sorted = NULL;
+	huffman->symbols = 0;
+}
+
+static int compare_leaves(const void* a, const void* b)
+{
+	const huffman_leaf_t* la = a;
+	const huffman_leaf_t* lb = b;
+
+	if (la->freq != lb->freq)
+		return la->freq < lb->freq ? -1 : 1;
+	return la->symbol < lb->symbol ? -1 : (la->symbol > lb->symbol);
+}
+
+// two-queue huffman over the sorted leaves, returns the longest code length
+static size_t build_lengths(huffman_leaf_t* leaves, size_t n, uint8_t* lengths)
+{
+	if (n == 1)
+	{
+		lengths[leaves[0].symbol] = 1;
+		return 1;
+	}
+
+	uint64_t* freqs = malloc(sizeof(uint64_t) * (2 * n - 1));
+	uint32_t* parents = malloc(sizeof(uint32_t) * (2 * n - 1));
+	uint8_t* depths = malloc(2 * n - 1);
+
+	for (size_t i = 0; i < n; ++i)
+		freqs[i] = leaves[i].freq;
+
+	size_t leaf = 0, node = n;
+	for (size_t next = n; next < 2 * n - 1; ++next)
+	{
+		size_t pick[2];
+		for (size_t k = 0; k < 2; ++k)
+		{
+			if (leaf < n && (node >= next || freqs[leaf] <= freqs[node]))
+				pick[k] = leaf++;
+			else
+				pick[k] = node++;
+		}
+
+		freqs[next] = freqs[pick[0]] + freqs[pick[1]];
+		parents[pick[0]] = next;
+		parents[pick[1]] = next;
+	}
+
+	size_t max_length = 0;
+	depths[2 * n - 2] = 0;
+	for (size_t i = 2 * n - 2; i-- > 0;)
+	{
+		depths[i] = depths[parents[i]] + 1;
+		if (i < n)
+		{
+			lengths[leaves[i].symbol] = depths[i];
+			max_length = depths[i] > max_length ? depths[i] : max_length;
+		}
+	}
+
+	free(depths);
+	free(parents);
+	free(freqs);
+
+	return max_length;
+}
+
+static void assign_codes(huffman_t* huffman)
+{
+	memset(huffman->counts, 0, sizeof(huffman->counts));
+	for (size_t i = 0; i < huffman->symbols; ++i)
+		huffman->counts[huffman->lengths[i]]++;
+	huffman->counts[0] = 0;
+
+	uint32_t code = 0;
+	uint32_t next_code[HUFFMAN_MAX_BITS + 1];
+	uint32_t offsets[HUFFMAN_MAX_BITS + 1];
+	uint32_t offset = 0;
+	for (size_t len = 1; len <= HUFFMAN_MAX_BITS; ++len)
+	{
+		code = (code + huffman->counts[len - 1]) << 1;
+		next_code[len] = code;
+		offsets[len] = offset;
+		offset += huffman->counts[len];
+	}
+
+	for (size_t i = 0; i < huffman->symbols; ++i)
+	{
+		uint8_t len = huffman->lengths[i];
+		if (!len)
+			continue;
+
+		huffman->codes[i] = next_code[len]++;
+		huffman->sorted[offsets[len]++] = i;
+	}
+}
+
+void huffman_build(huffman_t* huffman, const uint32_t* in_freqs)
+{
+	huffman_leaf_t* leaves = malloc(sizeof(huffman_leaf_t) * (huffman->symbols ? huffman->symbols : 1));
+
+	uint32_t shift = 0;
+	for (;;)
+	{
+		size_t n = 0;
+		for (size_t i = 0; i < huffman->symbols; ++i)
+		{
+			huffman->lengths[i] = 0;
+			if (!in_freqs[i])
+				continue;
+
+			leaves[n].freq = (in_freqs[i] >> shift) ? (in_freqs[i] >> shift) : 1;
+			leaves[n].symbol = i;
+			++n;
+		}
+
+		if (!n)
+			break;
+
+		qsort(leaves, n, sizeof(huffman_leaf_t), compare_leaves);
+
+		// flatten the distribution until the longest code fits
+		if (build_lengths(leaves, n, huffman->lengths) <= HUFFMAN_MAX_BITS)
+			break;
+		++shift;
+	}
+
+	free(leaves);
+
+	assign_codes(huffman);
+}
+
+// -1 when the table runs past the end of in, huffman is left alone then
+long huffman_load(const buffer_t* in, size_t offset, huffman_t* huffman)
+{
+	size_t count = buffer_count(in);
+	if (offset > count || count - offset < sizeof(uint32_t))
+		return -1;
+
+	uint32_t symbols;
+	memcpy(&symbols, buffer_get(in, offset), sizeof(symbols));
+	offset += sizeof(symbols);
+
+	symbols = u32be(symbols);
+	if (symbols > count - offset)
+		return -1;
+
+	huffman_init(huffman, symbols);
+	if (huffman->symbols > 0)
+	{
+		memcpy(huffman->lengths, buffer_get(in, offset), huffman->symbols);
+		offset += huffman->symbols;
+	}
+
+	for (size_t i = 0; i < huffman->symbols; ++i)
+	{
+		if (huffman->lengths[i] > HUFFMAN_MAX_BITS)
+			huffman->lengths[i] = 0;
+	}
+
+	assign_codes(huffman);
+
+	return offset;
+}
+
+void huffman_save(buffer_t* out, const huffman_t* huffman)
+{
+	uint32_t symbols = u32be(huffman->symbols);
+	buffer_add(out, &symbols, sizeof(symbols));
+	if (huffman->symbols > 0)
+		buffer_add(out, huffman->lengths, huffman->symbols);
+}
+
+void huffman_write(bits_t* bits, const huffman_t* huffman, uint32_t symbol)
+{
+	assert(symbol < huffman->symbols && huffman->lengths[symbol] > 0);
+
+	uint32_t code = huffman->codes[symbol];
+	for (size_t i = huffman->lengths[symbol]; i-- > 0;)
+		bits_write(bits, (code >> i) & 1, 1);
+}
+
+uint32_t huffman_read(bits_t* bits, const huffman_t* huffman)
+{
+	uint32_t code = 0;
+	uint32_t first = 0;
+	uint32_t index = 0;
+
+	for (size_t len = 1; len <= HUFFMAN_MAX_BITS; ++len)
+	{
+		code |= bits_read(bits, 1);
+
+		uint32_t count = huffman->counts[len];
+		if (code - first < count)
+			return huffman->sorted[index + (code - first)];
+
+		index += count;
+		first = (first + count) << 1;
+		code <<= 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "buffer.h"
+#include "bits.h"
+
+#define HUFFMAN_MAX_BITS (20)
+
+// static canonical huffman code over symbols 0..symbols-1
+typedef struct huffman_t
+{
+	size_t symbols;
+	uint8_t* lengths; // code length per symbol, 0 if unused
+	uint32_t* codes;
+
+	uint32_t counts[HUFFMAN_MAX_BITS + 1]; // number of codes of each length
+	uint32_t* sorted; // used symbols ordered by (length, symbol)
+} huffman_t;
+
+void huffman_init(huffman_t* huffman, size_t symbols);
+void huffman_release(huffman_t* huffman);
+
+void huffman_build(huffman_t* huffman, const uint32_t* freqs);
+
+long huffman_load(const buffer_t* in, size_t offset, huffman_t* huffman);
+void huffman_save(buffer_t* out, const huffman_t* huffman);
+
+void huffman_write(bits_t* bits, const huffman_t* huffman, uint32_t symbol);
+uint32_t huffman_read(bits_t* bits, const huffman_t* huffman);
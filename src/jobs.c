@@ -0,0 +1,140 @@
+#include "jobs.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#define MAX_JOB_THREADS (64)
+
+/*
+    the workers are started with the first run and stay for the life of the process. a run posts a new
+    generation and every thread, the caller too, pulls indices off the shared counter until they run out.
+    the next run waits until every worker has left the last one, so nobody pulls from a counter that
+    belongs to another run
+*/
+typedef struct jobs_t
+{
+	pthread_once_t started;
+	pthread_mutex_t submit; // one run at a time
+	pthread_mutex_t lock;
+	pthread_cond_t posted;
+	pthread_cond_t finished;
+
+	size_t threads; // workers, not counting the caller
+	size_t generation;
+	size_t active; // workers inside the current run
+	size_t done; // indices completed
+
+	atomic_size_t next;
+	size_t count;
+	job_func_t func;
+	void* context;
+} jobs_t;
+
+static jobs_t jobs =
+{
+	.started = PTHREAD_ONCE_INIT,
+	.submit = PTHREAD_MUTEX_INITIALIZER,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.posted = PTHREAD_COND_INITIALIZER,
+	.finished = PTHREAD_COND_INITIALIZER,
+};
+
+// set on the workers, a job that runs jobs of its own runs them in place
+static __thread int jobs_worker_thread;
+
+size_t jobs_concurrency()
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1)
+		return 1;
+	return cpus > MAX_JOB_THREADS ? MAX_JOB_THREADS : (size_t)cpus;
+}
+
+static size_t jobs_pull(job_func_t func, void* context, size_t count)
+{
+	size_t completed = 0;
+	for (size_t index; (index = atomic_fetch_add(&(jobs.next), 1)) < count; ++completed)
+		func(context, index);
+	return completed;
+}
+
+static void* jobs_worker(void* arg)
+{
+	(void)arg;
+	jobs_worker_thread = 1;
+
+	size_t seen = 0;
+	pthread_mutex_lock(&(jobs.lock));
+	for (;;)
+	{
+		while (jobs.generation == seen)
+			pthread_cond_wait(&(jobs.posted), &(jobs.lock));
+
+		seen = jobs.generation;
+		++(jobs.active);
+		job_func_t func = jobs.func;
+		void* context = jobs.context;
+		size_t count = jobs.count;
+		pthread_mutex_unlock(&(jobs.lock));
+
+		size_t completed = jobs_pull(func, context, count);
+
+		pthread_mutex_lock(&(jobs.lock));
+		jobs.done += completed;
+		--(jobs.active);
+		pthread_cond_broadcast(&(jobs.finished));
+	}
+
+	return NULL;
+}
+
+static void jobs_start()
+{
+	size_t threads = jobs_concurrency() - 1;
+	for (; jobs.threads < threads; ++(jobs.threads))
+	{
+		pthread_t worker;
+		if (pthread_create(&worker, NULL, jobs_worker, NULL) != 0)
+			break;
+		pthread_detach(worker);
+	}
+}
+
+// runs func(context, 0..count-1) across all cores, returns when every index has completed
+void jobs_run(job_func_t func, void* context, size_t count)
+{
+	pthread_once(&(jobs.started), jobs_start);
+
+	if (count <= 1 || !jobs.threads || jobs_worker_thread)
+	{
+		for (size_t i = 0; i < count; ++i)
+			func(context, i);
+		return;
+	}
+
+	pthread_mutex_lock(&(jobs.submit));
+
+	pthread_mutex_lock(&(jobs.lock));
+	while (jobs.active)
+		pthread_cond_wait(&(jobs.finished), &(jobs.lock));
+
+	atomic_store(&(jobs.next), 0);
+	jobs.count = count;
+	jobs.func = func;
+	jobs.context = context;
+	jobs.done = 0;
+	++(jobs.generation);
+	pthread_cond_broadcast(&(jobs.posted));
+	pthread_mutex_unlock(&(jobs.lock));
+
+	size_t completed = jobs_pull(func, context, count);
+
+	pthread_mutex_lock(&(jobs.lock));
+	jobs.done += completed;
+	while (jobs.done < count)
+		pthread_cond_wait(&(jobs.finished), &(jobs.lock));
+	pthread_mutex_unlock(&(jobs.lock));
+
+	pthread_mutex_unlock(&(jobs.submit));
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdlib.h>
+
+typedef void (*job_func_t)(void* context, size_t index);
+
+size_t jobs_concurrency();
+void jobs_run(job_func_t func, void* context, size_t count);
@@ -0,0 +1,239 @@
+#include "metatiles.h"
+
+#include "stream.h"
+
+#include <string.h>
+#include <stdio.h>
+
+static uint32_t metatile_variants[] = {
+    0,
+    TILE_FLIP_Y,
+    TILE_INVERT,
+    TILE_INVERT|TILE_FLIP_Y,
+    TILE_FLIP_X,
+    TILE_FLIP_X|TILE_FLIP_Y,
+    TILE_INVERT|TILE_FLIP_X,
+    TILE_INVERT|TILE_FLIP_X|TILE_FLIP_Y
+};
+
+#define sizeof_array(x) (sizeof(x) / sizeof(x[0]))
+
+// the same for every variant, flags only move tiles around
+static uint32_t hash_metatile(const tile_index_t* indices)
+{
+	uint32_t temp = 0;
+	for (size_t i = 0; i < METATILE_INDEX_COUNT; ++i)
+		temp += (indices[i] & ~TILE_BITS_MASK) * 2654435761U;
+	return temp;
+}
+
+// flipping the metatile flips each tile and swaps their places, all variants are their own inverse
+static void metatile_variant(tile_index_t* out, const tile_index_t* in, uint32_t variant)
+{
+	for (size_t y = 0; y < METATILE_HEIGHT; ++y)
+	{
+		for (size_t x = 0; x < METATILE_WIDTH; ++x)
+		{
+			size_t sx = (variant & TILE_FLIP_X) ? METATILE_WIDTH - (x + 1) : x;
+			size_t sy = (variant & TILE_FLIP_Y) ? METATILE_HEIGHT - (y + 1) : y;
+			out[x + y * METATILE_WIDTH] = in[sx + sy * METATILE_WIDTH] ^ variant;
+		}
+	}
+}
+
+void metatiles_init(metatiles_t* metatiles)
+{
+	buffer_init(&(metatiles->buffer), sizeof(metatile_t));
+
+	for (size_t i = 0; i < METATILES_HASH_SIZE; ++i)
+		metatiles->hash[i] = NO_METATILE;
+}
+
+void metatiles_release(metatiles_t* metatiles)
+{
+	buffer_release(&(metatiles->buffer));
+}
+
+metatile_t metatiles_get(const metatiles_t* metatiles, metatile_index_t index)
+{
+	const metatile_t* in = buffer_get(&(metatiles->buffer), index & ~TILE_BITS_MASK);
+
+	metatile_t out = *in;
+	metatile_variant(out.indices, in->indices, index & TILE_BITS_MASK);
+	return out;
+}
+
+metatile_index_t metatiles_match(const metatiles_t* metatiles, const tile_index_t* indices)
+{
+	uint32_t hash = hash_metatile(indices) & (METATILES_HASH_SIZE-1);
+
+	for (size_t i = 0; i < sizeof_array(metatile_variants); ++i)
+	{
+		uint32_t variant = metatile_variants[i];
+
+		tile_index_t temp[METATILE_INDEX_COUNT];
+		metatile_variant(temp, indices, variant);
+
+		for (uint32_t index = metatiles->hash[hash]; index != NO_METATILE;)
+		{
+			const metatile_t* candidate = buffer_get(&(metatiles->buffer), index);
+			if (!memcmp(candidate->indices, temp, sizeof(temp)))
+				return index | variant;
+			index = candidate->next;
+		}
+	}
+
+	return NO_METATILE;
+}
+
+metatile_index_t metatiles_insert(metatiles_t* metatiles, const tile_index_t* indices)
+{
+	metatile_index_t index = metatiles_match(metatiles, indices);
+	if (index != NO_METATILE)
+	{
+		metatile_t* found = buffer_get(&(metatiles->buffer), index & ~TILE_BITS_MASK);
+		found->count++;
+		return index;
+	}
+
+	metatile_t* out = buffer_alloc(&(metatiles->buffer), 1);
+	memcpy(out->indices, indices, sizeof(out->indices));
+
+	uint32_t offset = buffer_offset(&(metatiles->buffer), out);
+	uint32_t hash = hash_metatile(indices) & (METATILES_HASH_SIZE-1);
+	out->next = metatiles->hash[hash];
+	metatiles->hash[hash] = offset;
+
+	out->count = 1;
+
+	return offset;
+}
+
+static void metatiles_rehash(metatiles_t* metatiles)
+{
+	for (size_t i = 0; i < METATILES_HASH_SIZE; ++i)
+		metatiles->hash[i] = NO_METATILE;
+
+	for (size_t i = 0, n = buffer_count(&(metatiles->buffer)); i < n; ++i)
+	{
+		metatile_t* curr = buffer_get(&(metatiles->buffer), i);
+		uint32_t hash = hash_metatile(curr->indices) & (METATILES_HASH_SIZE-1);
+		curr->next = metatiles->hash[hash];
+		metatiles->hash[hash] = i;
+	}
+}
+
+// nothing references metatiles yet when they are built, so the rarely used ones can just go
+void metatiles_prune(metatiles_t* metatiles, size_t min_count)
+{
+	buffer_t old = metatiles->buffer;
+	buffer_init(&(metatiles->buffer), old.elemsize);
+
+	for (size_t i = 0, n = buffer_count(&old); i < n; ++i)
+	{
+		const metatile_t* curr = buffer_get(&old, i);
+		if (curr->count < min_count)
+			continue;
+
+		metatile_t* out = buffer_alloc(&(metatiles->buffer), 1);
+		*out = *curr;
+	}
+
+	fprintf(stderr, "metatiles: kept %lu of %lu used at least %lu times\n", buffer_count(&(metatiles->buffer)), buffer_count(&old), min_count);
+
+	buffer_release(&old);
+	metatiles_rehash(metatiles);
+}
+
+void metatiles_remap_tiles(metatiles_t* metatiles, const tile_index_t* remaps)
+{
+	for (size_t i = 0, n = buffer_count(&(metatiles->buffer)); i < n; ++i)
+	{
+		metatile_t* curr = buffer_get(&(metatiles->buffer), i);
+		for (size_t j = 0; j < METATILE_INDEX_COUNT; ++j)
+		{
+			uint32_t in = curr->indices[j];
+			uint32_t remap = remaps[(in & ~TILE_BITS_MASK)];
+			curr->indices[j] = (remap & ~TILE_BITS_MASK) | ((remap & TILE_BITS_MASK) ^ (in & TILE_BITS_MASK));
+		}
+	}
+
+	metatiles_rehash(metatiles);
+}
+
+// tile indices are stored like tiles store block indices, 16 bits with the flags on top when they fit
+static uint16_t mi_compress(tile_index_t index)
+{
+	return ((index & TILE_BITS_MASK) >> 16) | (index & 0x1fff);
+}
+
+static tile_index_t mi_uncompress(uint16_t in)
+{
+	return ((uint32_t)(in & 0xe000) << 16) | (in & 0x1fff);
+}
+
+long metatiles_load(const buffer_t* in, size_t offset, metatiles_t* metatiles, size_t tile_bits)
+{
+	if (offset > buffer_count(in) || buffer_count(in) - offset < sizeof(uint32_t))
+		return -1;
+
+	uint32_t count;
+	memcpy(&count, buffer_get(in, offset), sizeof(count));
+	offset += sizeof(count);
+	count = u32be(count);
+
+	size_t entry = (tile_bits > 16 ? sizeof(uint32_t) : sizeof(uint16_t)) * METATILE_INDEX_COUNT;
+	if ((buffer_count(in) - offset) / entry < count)
+		return -1;
+
+	buffer_reserve(&(metatiles->buffer), count);
+	for (size_t i = 0; i < count; ++i)
+	{
+		metatile_t* curr = buffer_alloc(&(metatiles->buffer), 1);
+		for (size_t j = 0; j < METATILE_INDEX_COUNT; ++j)
+		{
+			if (tile_bits > 16)
+			{
+				uint32_t temp;
+				memcpy(&temp, buffer_get(in, offset), sizeof(temp));
+				curr->indices[j] = u32be(temp);
+				offset += sizeof(temp);
+			}
+			else
+			{
+				uint16_t temp;
+				memcpy(&temp, buffer_get(in, offset), sizeof(temp));
+				curr->indices[j] = mi_uncompress(u16be(temp));
+				offset += sizeof(temp);
+			}
+		}
+		curr->count = 0;
+	}
+
+	metatiles_rehash(metatiles);
+	return offset;
+}
+
+void metatiles_save(buffer_t* out, const metatiles_t* metatiles, size_t tile_bits)
+{
+	uint32_t count = u32be(buffer_count(&(metatiles->buffer)));
+	buffer_add(out, &count, sizeof(count));
+
+	for (size_t i = 0, n = buffer_count(&(metatiles->buffer)); i < n; ++i)
+	{
+		const metatile_t* curr = buffer_get(&(metatiles->buffer), i);
+		for (size_t j = 0; j < METATILE_INDEX_COUNT; ++j)
+		{
+			if (tile_bits > 16)
+			{
+				uint32_t temp = u32be(curr->indices[j]);
+				buffer_add(out, &temp, sizeof(temp));
+			}
+			else
+			{
+				uint16_t temp = u16be(mi_compress(curr->indices[j]));
+				buffer_add(out, &temp, sizeof(temp));
+			}
+		}
+	}
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "tiles.h"
+
+#define METATILES_HASH_SIZE (256)
+
+// in tiles
+#define METATILE_WIDTH (2)
+#define METATILE_HEIGHT (2)
+#define METATILE_INDEX_COUNT (METATILE_WIDTH * METATILE_HEIGHT)
+
+// flag bits are the TILE_* ones, applied to the whole metatile
+typedef uint32_t metatile_index_t;
+#define NO_METATILE 0xffffffff
+
+typedef struct metatile_t
+{
+	tile_index_t indices[METATILE_INDEX_COUNT];
+
+	uint32_t next; // index to next metatile in hash
+	uint32_t count; // number of uses
+} metatile_t;
+
+typedef struct metatiles_t
+{
+	buffer_t buffer;
+	uint32_t hash[METATILES_HASH_SIZE];
+} metatiles_t;
+
+void metatiles_init(metatiles_t* metatiles);
+void metatiles_release(metatiles_t* metatiles);
+
+metatile_t metatiles_get(const metatiles_t* metatiles, metatile_index_t index);
+metatile_index_t metatiles_match(const metatiles_t* metatiles, const tile_index_t* indices);
+metatile_index_t metatiles_insert(metatiles_t* metatiles, const tile_index_t* indices);
+
+void metatiles_prune(metatiles_t* metatiles, size_t min_count);
+void metatiles_remap_tiles(metatiles_t* metatiles, const tile_index_t* remaps);
+
+long metatiles_load(const buffer_t* in, size_t offset, metatiles_t* metatiles, size_t tile_bits);
+void metatiles_save(buffer_t* out, const metatiles_t* metatiles, size_t tile_bits);
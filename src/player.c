@@ -1,58 +1,340 @@
 #include "renderer.h"
-#include "stream.h"
-#include "frames.h"
+#include "decoder.h"
 
 #include <string.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <errno.h>
 
-int main(int argc, char* argv[])
+#define FRAME_RATE (25) // of the source clip
+#define RING_FRAMES (4) // decoded ahead by the decode thread
+#define LATE_NS (2000000) // presented this much after its time counts as late
+
+// runs of dirty tiles along a row of the map become one rect
+static size_t dirty_rects(const uint16_t* positions, size_t count, renderer_rect_t* rects)
 {
-	uint8_t buffer[FRAME_WIDTH * FRAME_HEIGHT];
+	size_t out = 0;
+	for (size_t i = 0; i < count;)
+	{
+		size_t p = positions[i], end = i + 1;
+		while (end < count && positions[end] == p + (end - i) && (p + (end - i)) % FRAME_TILES_X != 0)
+			++end;
 
-	if (renderer_create(FRAME_WIDTH, FRAME_HEIGHT, RENDER_VISIBLE) < 0)
-		return -1;
+		renderer_rect_t* rect = &rects[out++];
+		rect->x = (p % FRAME_TILES_X) * TILE_WIDTH;
+		rect->y = (p / FRAME_TILES_X) * TILE_HEIGHT;
+		rect->width = (end - i) * TILE_WIDTH;
+		rect->height = TILE_HEIGHT;
 
-	stream_t* stream = stream_create();
+		i = end;
+	}
 
-	FILE* in = fopen("anim.bin", "rb");
-	if (!in)
-		return -1;
+	return out;
+}
+
+#define PLANE_PITCH (FRAME_WIDTH / 8)
 
-	if (stream_load(stream, in) < 0)
+// the display is 8bpp, a planar frame is turned back into gray levels where it changed
+static void planar_to_chunky(const uint8_t* planar, size_t planes, uint8_t* pixels, uint32_t pitch, const renderer_rect_t* rect)
+{
+	size_t levels = (1 << planes) - 1;
+	for (uint32_t y = rect->y; y < rect->y + rect->height; ++y)
 	{
-		fprintf(stderr, "Could not read stream\n");
-		return -1;
+		for (uint32_t x = rect->x; x < rect->x + rect->width; ++x)
+		{
+			size_t level = 0;
+			for (size_t k = 0; k < planes; ++k)
+				level |= ((planar[k * PLANE_PITCH * FRAME_HEIGHT + y * PLANE_PITCH + x / 8] >> (7 - (x % 8))) & 1) << k;
+			pixels[x + y * pitch] = (level * 255) / levels;
+		}
+	}
+}
+
+// the maps of a frame and what changed from the one before, drawn by the present thread
+typedef struct ring_frame_t
+{
+	frame_t maps[FRAME_MAX_PLANES];
+	uint16_t dirty[FRAME_TILE_COUNT];
+	size_t count;
+} ring_frame_t;
+
+typedef struct player_t
+{
+	decoder_t* decoder;
+	int use_planar;
+	int paced; // off for -bench, every frame goes up as soon as it is drawn
+
+	ring_frame_t ring[RING_FRAMES];
+	size_t depth; // frames decoded ahead, 1 when the maps of the next one would overwrite the slots of the one drawn
+	size_t head; // frames written
+	size_t tail; // frames presented or dropped
+	int done;
+	int quit;
+
+	pthread_mutex_t lock;
+	pthread_cond_t filled;
+	pthread_cond_t emptied;
+
+	// held while decoding appends to the dictionaries and while drawing reads them
+	pthread_mutex_t dictionaries;
+
+	uint8_t planar[FRAME_MAX_PLANES * PLANE_PITCH * FRAME_HEIGHT]; // -planar draws here first
+} player_t;
+
+static uint64_t now_ns()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns)
+{
+	struct timespec until = { ns / 1000000000ULL, ns % 1000000000ULL };
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR)
+		;
+}
+
+// decodes the maps of every frame into the ring, waiting while the ring is full
+static void* player_decode(void* arg)
+{
+	player_t* player = arg;
+	decoder_t* decoder = player->decoder;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&(player->lock));
+		while (player->head - player->tail >= player->depth && !player->quit)
+			pthread_cond_wait(&(player->emptied), &(player->lock));
+		int quit = player->quit;
+		pthread_mutex_unlock(&(player->lock));
+
+		if (quit)
+			break;
+
+		// the slot is past the tail, the present thread is not reading it
+		ring_frame_t* frame = &(player->ring[player->head % RING_FRAMES]);
+
+		pthread_mutex_lock(&(player->dictionaries));
+		const frame_t* maps = decoder_next_tilemap(decoder, NULL);
+		pthread_mutex_unlock(&(player->dictionaries));
+
+		if (!maps)
+			break;
+
+		memcpy(frame->maps, maps, sizeof(frame_t) * decoder->planes);
+		memcpy(frame->dirty, decoder->dirty, sizeof(uint16_t) * decoder->dirty_count);
+		frame->count = decoder->dirty_count;
+
+		pthread_mutex_lock(&(player->lock));
+		++(player->head);
+		pthread_cond_signal(&(player->filled));
+		pthread_mutex_unlock(&(player->lock));
+	}
+
+	pthread_mutex_lock(&(player->lock));
+	player->done = 1;
+	pthread_cond_signal(&(player->filled));
+	pthread_mutex_unlock(&(player->lock));
+
+	return NULL;
+}
+
+// stale positions of frame straight into the window's pixels, rects for renderer_present
+static size_t player_draw(player_t* player, const ring_frame_t* frame, uint8_t* stale, renderer_rect_t* rects)
+{
+	decoder_t* decoder = player->decoder;
+	uint8_t* planar = player->planar;
+
+	for (size_t i = 0; i < frame->count; ++i)
+		stale[frame->dirty[i]] = 1;
+
+	uint16_t positions[FRAME_TILE_COUNT];
+	size_t count = 0;
+	for (size_t p = 0; p < FRAME_TILE_COUNT; ++p)
+	{
+		if (stale[p])
+			positions[count++] = p;
+	}
+	memset(stale, 0, FRAME_TILE_COUNT);
+
+	if (!count)
+		return 0;
+
+	uint32_t pitch;
+	uint8_t* pixels = renderer_lock(&pitch);
+	if (!pixels)
+		return 0;
+
+	pthread_mutex_lock(&(player->dictionaries));
+	if (player->use_planar)
+		decoder_render_maps(decoder, frame->maps, positions, count, planar, PLANE_PITCH, DECODER_FORMAT_PLANAR);
+	else
+		decoder_render_maps(decoder, frame->maps, positions, count, pixels, pitch, DECODER_FORMAT_8BPP);
+	pthread_mutex_unlock(&(player->dictionaries));
+
+	size_t rect_count = dirty_rects(positions, count, rects);
+	if (player->use_planar)
+	{
+		for (size_t i = 0; i < rect_count; ++i)
+			planar_to_chunky(planar, decoder->planes, pixels, pitch, &rects[i]);
 	}
 
-	const tiles_t* tiles = &(stream->tiles);
-	const frames_t* frames = &(stream->frames);
+	return rect_count;
+}
+
+/*
+    frame i is due at start + i / FRAME_RATE on the monotonic clock. a frame still waiting more than a
+    frame after its time is dropped when the next one is ready, and when the ring runs dry the last frame
+    stays up until the decoder catches up. frames are drawn into the window's own pixels, the tiles a
+    dropped frame changed are drawn with the next one shown
+*/
+static int player_present(player_t* player)
+{
+	const uint64_t period = 1000000000ULL / FRAME_RATE;
+
+	size_t shown = 0, dropped = 0, late = 0, holds = 0;
+	uint64_t worst = 0;
+
+	uint8_t stale[FRAME_TILE_COUNT];
+	memset(stale, 0, sizeof(stale));
+	renderer_rect_t rects[FRAME_TILE_COUNT];
 
-	for (size_t index = 0, n = buffer_count(&(frames->buffer)); index < n; ++index)
+	uint64_t start = now_ns();
+	uint64_t progress = start; // the progress line goes out once a second, not with every frame
+	for (size_t index = 0;; ++index)
 	{
-		const frame_t* frame = (const frame_t*)buffer_get(&(frames->buffer), index);
+		uint64_t due = player->paced ? start + index * period : 0;
 
-		size_t count = 0;
-        const tile_index_t* indices = frame->tiles;
-		for (size_t y = 0; y < FRAME_HEIGHT; y += TILE_HEIGHT)
+		pthread_mutex_lock(&(player->lock));
+		if (player->head == player->tail && !player->done && now_ns() > due && player->paced)
+			++holds;
+		while (player->head == player->tail && !player->done)
+			pthread_cond_wait(&(player->filled), &(player->lock));
+		size_t ready = player->head - player->tail;
+		pthread_mutex_unlock(&(player->lock));
+
+		if (!ready)
+			break;
+
+		const ring_frame_t* frame = &(player->ring[player->tail % RING_FRAMES]);
+		uint64_t now = now_ns();
+
+		if (player->paced && now > due + period && ready > 1)
 		{
-			for (size_t x = 0; x < FRAME_WIDTH; x += TILE_WIDTH)
+			for (size_t i = 0; i < frame->count; ++i)
+				stale[frame->dirty[i]] = 1;
+			++dropped;
+		}
+		else
+		{
+			size_t count = player_draw(player, frame, stale, rects);
+
+			now = now_ns();
+			if (now < due)
+				sleep_until(due);
+			else if (player->paced && now - due > LATE_NS)
 			{
-                tile_index_t ti = *(indices++);
-                const tile_t tile = tiles_get(tiles, ti);
-				uint8_t* target = &buffer[x + y * FRAME_WIDTH];
+				++late;
+				worst = (now - due) > worst ? (now - due) : worst;
+			}
+
+			if (renderer_present(rects, count, 0) < 0)
+				return -1;
 
-				tile_render(target, tiles, &tile, ti & TILE_BITS_MASK, FRAME_WIDTH);
-				++count;
+			++shown;
+			if (player->paced && now_ns() - progress >= 1000000000ULL)
+			{
+				fprintf(stderr, "\rframe: %lu rects: %lu dropped: %lu late: %lu    ", index, count, dropped, late);
+				progress = now_ns();
 			}
 		}
 
-		fprintf(stderr, "\rframe: %lu tiles: %lu    ", index, count);
+		pthread_mutex_lock(&(player->lock));
+		++(player->tail);
+		pthread_cond_signal(&(player->emptied));
+		pthread_mutex_unlock(&(player->lock));
+	}
+
+	double elapsed = (now_ns() - start) / 1000000000.0;
+	if (player->paced)
+		fprintf(stderr, "\n%lu frames shown, %lu dropped, %lu late (worst %.1f ms), %lu held waiting on the decoder, %.2f s for %.2f s of video\n",
+			shown, dropped, late, worst / 1000000.0, holds, elapsed, (double)(shown + dropped) / FRAME_RATE);
+	else
+		fprintf(stderr, "%lu frames decoded, drawn and presented in %.1f ms, %.0f frames/s (%.2f us/frame)\n",
+			shown, elapsed * 1000.0, elapsed > 0 ? shown / elapsed : 0.0, shown ? elapsed * 1000000.0 / shown : 0.0);
+	return 0;
+}
 
-		if (renderer_update(FRAME_WIDTH, FRAME_HEIGHT, buffer, 16 * (2)) < 0)
-			return -1;
+/*
+    player [-planar] [-texture] [-bench]. -planar decodes to bitplanes the way the target machine would,
+    -texture presents through a streaming texture, -bench runs unpaced on SDL's dummy video driver
+*/
+int main(int argc, char* argv[])
+{
+	static player_t player;
+	player.paced = 1;
+
+	uint32_t flags = RENDER_VISIBLE;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (!strcmp(argv[i], "-planar"))
+			player.use_planar = 1;
+		else if (!strcmp(argv[i], "-texture"))
+			flags |= RENDER_TEXTURE;
+		else if (!strcmp(argv[i], "-bench"))
+			player.paced = 0;
 	}
 
-	fprintf(stderr, "\n");
+	if (!player.paced)
+		setenv("SDL_VIDEODRIVER", "dummy", 1);
+
+	if (renderer_create(FRAME_WIDTH, FRAME_HEIGHT, flags) < 0)
+		return -1;
+
+	int fd = open("anim.bin", O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	player.decoder = decoder_open_fd(fd);
+	close(fd);
+
+	if (!player.decoder)
+	{
+		fprintf(stderr, "Could not read stream\n");
+		return -1;
+	}
+
+	player.depth = player.decoder->in_place ? 1 : RING_FRAMES;
+
+	pthread_mutex_init(&(player.lock), NULL);
+	pthread_mutex_init(&(player.dictionaries), NULL);
+	pthread_cond_init(&(player.filled), NULL);
+	pthread_cond_init(&(player.emptied), NULL);
+
+	// the window stays with this thread, decoding goes to another
+	pthread_t decode;
+	if (pthread_create(&decode, NULL, player_decode, &player) != 0)
+		return -1;
+
+	if (player_present(&player) < 0)
+	{
+		pthread_mutex_lock(&(player.lock));
+		player.quit = 1;
+		pthread_cond_signal(&(player.emptied));
+		pthread_mutex_unlock(&(player.lock));
+	}
+
+	pthread_join(decode, NULL);
+
+	pthread_cond_destroy(&(player.emptied));
+	pthread_cond_destroy(&(player.filled));
+	pthread_mutex_destroy(&(player.dictionaries));
+	pthread_mutex_destroy(&(player.lock));
 
+	decoder_close(player.decoder);
 	renderer_destroy();
 }
@@ -4,18 +4,25 @@
 
 SDL_Window* window = NULL;
 SDL_Surface* buffer = NULL;
+SDL_Rect* rects = NULL;
+size_t rects_capacity = 0;
+
+// RENDER_TEXTURE, the 8bpp surface goes up through a streaming texture, converted by table on the way
+SDL_Renderer* renderer = NULL;
+SDL_Texture* texture = NULL;
+uint32_t colors[256];
 
 //#define DEBUG_COLORS
 
 int renderer_create(uint32_t width, uint32_t height, uint32_t flags)
 {
-	if (SDL_Init((flags == RENDER_VISIBLE) ? SDL_INIT_EVERYTHING : SDL_INIT_EVENTS) < 0)
+	if (SDL_Init((flags & RENDER_VISIBLE) ? SDL_INIT_VIDEO : SDL_INIT_EVENTS) < 0)
 	{
 		fprintf(stderr, "Could not initialize SDL\n");
 		return -1;
 	}
 
-	if (flags == RENDER_VISIBLE)
+	if (flags & RENDER_VISIBLE)
 	{
 		if (!(window = SDL_CreateWindow("", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, width, height, 0)))
 		{
@@ -58,12 +65,30 @@ int renderer_create(uint32_t width, uint32_t height, uint32_t flags)
 #endif
 
 		SDL_SetPaletteColors(buffer->format->palette, palette, 0, 256);
+
+		if (flags & RENDER_TEXTURE)
+		{
+			if (!(renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE)))
+			{
+				fprintf(stderr, "Could not create renderer\n");
+				return -1;
+			}
+
+			if (!(texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, width, height)))
+			{
+				fprintf(stderr, "Could not create texture\n");
+				return -1;
+			}
+
+			for (int i = 0; i < 256; ++i)
+				colors[i] = (0xffU << 24) | (palette[i].r << 16) | (palette[i].g << 8) | palette[i].b;
+		}
 	}
 
 	return 0;
 }
 
-int renderer_update(uint32_t width, uint32_t height, uint8_t* bytes, uint32_t sleepTime)
+static int renderer_poll()
 {
 	SDL_Event event;
 	if (SDL_PollEvent(&event))
@@ -74,19 +99,107 @@ int renderer_update(uint32_t width, uint32_t height, uint8_t* bytes, uint32_t sl
 		}
 	}
 
-	if (!window)
-		return 0;
+	return 0;
+}
+
+int renderer_update(uint32_t width, uint32_t height, uint8_t* bytes, uint32_t sleepTime)
+{
+	renderer_rect_t whole = { 0, 0, width, height };
+	return renderer_update_rects(width, height, bytes, &whole, 1, sleepTime);
+}
+
+int renderer_update_rects(uint32_t width, uint32_t height, uint8_t* bytes, const renderer_rect_t* in, size_t count, uint32_t sleepTime)
+{
+	uint32_t pitch;
+	uint8_t* pixels = renderer_lock(&pitch);
+	if (!pixels)
+		return window ? -1 : renderer_present(in, 0, sleepTime);
 
-	if (SDL_LockSurface(buffer) < 0)
+	for (size_t i = 0; i < count; ++i)
+	{
+		const renderer_rect_t* rect = &in[i];
+		for (uint32_t y = rect->y; y < rect->y + rect->height; ++y)
+			memcpy(&pixels[y * pitch + rect->x], &bytes[y * width + rect->x], rect->width);
+	}
+
+	return renderer_present(in, count, sleepTime);
+}
+
+uint8_t* renderer_lock(uint32_t* pitch)
+{
+	if (!window || SDL_LockSurface(buffer) < 0)
+		return NULL;
+
+	*pitch = buffer->pitch;
+	return buffer->pixels;
+}
+
+// the 8bpp rects into argb, locking only the part of the texture that gets written
+static int present_texture(const SDL_Rect* rects, size_t count)
+{
+	for (size_t i = 0; i < count; ++i)
+	{
+		void* locked;
+		int pitch;
+		if (SDL_LockTexture(texture, &rects[i], &locked, &pitch) < 0)
+			return -1;
+
+		for (int y = 0; y < rects[i].h; ++y)
+		{
+			const uint8_t* in = (const uint8_t*)buffer->pixels + (rects[i].y + y) * buffer->pitch + rects[i].x;
+			uint32_t* out = (uint32_t*)((uint8_t*)locked + y * pitch);
+			for (int x = 0; x < rects[i].w; ++x)
+				out[x] = colors[in[x]];
+		}
+
+		SDL_UnlockTexture(texture);
+	}
+
+	SDL_RenderCopy(renderer, texture, NULL, NULL);
+	SDL_RenderPresent(renderer);
+	return 0;
+}
+
+int renderer_present(const renderer_rect_t* in, size_t count, uint32_t sleepTime)
+{
+	if (renderer_poll() < 0)
 		return -1;
 
-	memcpy(buffer->pixels, bytes, width * height);
+	if (!window)
+		return 0;
 
+	// does nothing when renderer_lock was not called
 	SDL_UnlockSurface(buffer);
 
-	SDL_Surface* screen = SDL_GetWindowSurface(window);
-	SDL_BlitSurface(buffer, NULL, screen, NULL);
-	SDL_UpdateWindowSurface(window);
+	if (count > rects_capacity)
+	{
+		rects_capacity = count;
+		rects = realloc(rects, sizeof(SDL_Rect) * rects_capacity);
+	}
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		rects[i].x = in[i].x;
+		rects[i].y = in[i].y;
+		rects[i].w = in[i].width;
+		rects[i].h = in[i].height;
+	}
+
+	if (count && texture)
+	{
+		if (present_texture(rects, count) < 0)
+			return -1;
+	}
+	else if (count)
+	{
+		SDL_Surface* screen = SDL_GetWindowSurface(window);
+		for (size_t i = 0; i < count; ++i)
+		{
+			SDL_Rect target = rects[i];
+			SDL_BlitSurface(buffer, &rects[i], screen, &target);
+		}
+		SDL_UpdateWindowSurfaceRects(window, rects, count);
+	}
 
 	if (sleepTime > 0)
 		SDL_Delay(sleepTime);
@@ -96,6 +209,22 @@ int renderer_update(uint32_t width, uint32_t height, uint8_t* bytes, uint32_t sl
 
 void renderer_destroy()
 {
+	free(rects);
+	rects = NULL;
+	rects_capacity = 0;
+
+	if (texture)
+	{
+		SDL_DestroyTexture(texture);
+		texture = NULL;
+	}
+
+	if (renderer)
+	{
+		SDL_DestroyRenderer(renderer);
+		renderer = NULL;
+	}
+
 	if (buffer)
 	{
 		SDL_FreeSurface(buffer);
@@ -1,9 +1,25 @@
 #pragma once
 
 #include <stdint.h>
+#include <stddef.h>
 
 #define RENDER_VISIBLE (1)
+#define RENDER_TEXTURE (2) // with RENDER_VISIBLE, present through a streaming texture of the software renderer instead of the window surface
 
 int renderer_create(uint32_t width, uint32_t height, uint32_t flags);
+typedef struct renderer_rect_t
+{
+	uint32_t x, y, width, height;
+} renderer_rect_t;
+
 int renderer_update(uint32_t width, uint32_t height, uint8_t* bytes, uint32_t sleepTime);
+// copies and presents only rects of bytes, the rest of the window keeps what it showed
+int renderer_update_rects(uint32_t width, uint32_t height, uint8_t* bytes, const renderer_rect_t* rects, size_t count, uint32_t sleepTime);
+
+/*
+    without the copy: the 8bpp frame itself to draw into, NULL without a window. it keeps what was drawn
+    before, renderer_present then puts up the rects that changed
+*/
+uint8_t* renderer_lock(uint32_t* pitch);
+int renderer_present(const renderer_rect_t* rects, size_t count, uint32_t sleepTime);
 void renderer_destroy();
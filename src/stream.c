@@ -5,12 +5,16 @@
 #include "blocks.h"
 #include "buffer.h"
 #include "bits.h"
+#include "jobs.h"
+#include "codec.h"
+#include "cache.h"
 
 #include "../external/fastlz/fastlz.h"
 
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
+#include <time.h>
 #include <arpa/inet.h>
 
 stream_t* stream_create()
@@ -19,6 +23,14 @@ stream_t* stream_create()
 
 	frames_init(&(stream->frames));
 	tiles_init(&(stream->tiles));
+	metatiles_init(&(stream->metatiles));
+
+	stream->flags = 0;
+	stream->decode_budget = STREAM_DECODE_COST_ENTROPY;
+	cost_init(&(stream->cost));
+	stream->patched = 0;
+	stream->cache_tiles = 0;
+	stream->cache_blocks = 0;
 
 	return stream;
 }
@@ -39,42 +51,178 @@ uint16_t u16be(uint16_t in)
     return htons(in);
 }
 
-static void compress_buffer(buffer_t* out, const buffer_t* in)
+typedef struct stream_codec_t
 {
-    char tempbuf[STREAM_BLOCK_MAX_SIZE * 2];
+    const char* name;
+    uint32_t decode_cost;
 
-    for (size_t offset = 0, n = buffer_count(in); offset < n;)
+    size_t (*compress)(const uint8_t* in, size_t length, uint8_t* out, size_t maxout);
+    int (*decompress)(const uint8_t* in, size_t length, uint8_t* out, size_t maxout);
+} stream_codec_t;
+
+// fastlz takes no output bound, it can write up to 5% over the input plus 66 bytes
+#define FASTLZ_MAX_OUTPUT(length) ((length) + (length) / 20 + 66)
+
+// 0 leaves the chunk to the other codecs when the worst case would not fit
+static size_t fastlz1_compress(const uint8_t* in, size_t length, uint8_t* out, size_t maxout)
+{
+    if (maxout < FASTLZ_MAX_OUTPUT(length))
+        return 0;
+    return fastlz_compress_level(1, in, length, out);
+}
+
+static size_t fastlz2_compress(const uint8_t* in, size_t length, uint8_t* out, size_t maxout)
+{
+    if (maxout < FASTLZ_MAX_OUTPUT(length))
+        return 0;
+    return fastlz_compress_level(2, in, length, out);
+}
+
+static int fastlz_decompress_chunk(const uint8_t* in, size_t length, uint8_t* out, size_t maxout)
+{
+    return fastlz_decompress(in, length, out, maxout);
+}
+
+static int stored_decompress(const uint8_t* in, size_t length, uint8_t* out, size_t maxout)
+{
+    if (length != maxout)
+        return -1;
+
+    memcpy(out, in, length);
+    return length;
+}
+
+// indexed by STREAM_CODEC_*, candidates are tried in order of increasing decode cost
+static const stream_codec_t stream_codecs[STREAM_CODEC_COUNT] =
+{
+    { "stored", STREAM_DECODE_COST_COPY, NULL, stored_decompress },
+    { "fastlz1", STREAM_DECODE_COST_FASTLZ, fastlz1_compress, fastlz_decompress_chunk },
+    { "fastlz2", STREAM_DECODE_COST_FASTLZ, fastlz2_compress, fastlz_decompress_chunk },
+    { "lz", STREAM_DECODE_COST_LZ, lz_compress, lz_decompress },
+    { "rans", STREAM_DECODE_COST_ENTROPY, rans_compress, rans_decompress },
+};
+
+static const uint8_t stream_codec_order[] = { STREAM_CODEC_LZ, STREAM_CODEC_FASTLZ1, STREAM_CODEC_FASTLZ2, STREAM_CODEC_RANS };
+
+#define CHUNK_SCRATCH_SIZE (STREAM_BLOCK_MAX_SIZE * 2)
+
+typedef struct compress_job_t
+{
+    const buffer_t* in;
+    uint32_t decode_budget;
+
+    uint8_t* out; // STREAM_BLOCK_MAX_SIZE per chunk, the winning encoding unless the chunk is stored
+    size_t* sizes;
+    uint8_t* codecs;
+} compress_job_t;
+
+static void compress_chunk(void* context, size_t index)
+{
+    compress_job_t* job = context;
+
+    size_t offset = index * STREAM_BLOCK_MAX_SIZE;
+    size_t n = buffer_count(job->in);
+    size_t block_size = (n-offset) > STREAM_BLOCK_MAX_SIZE ? STREAM_BLOCK_MAX_SIZE : (n-offset);
+
+    // two slots, best candidate and trial
+    const uint8_t* src = buffer_get(job->in, offset);
+    uint8_t* scratch = malloc(CHUNK_SCRATCH_SIZE * 2);
+
+    uint8_t best_codec = STREAM_CODEC_STORED;
+    size_t best_size = block_size;
+    uint8_t best_slot = 0;
+
+    for (size_t i = 0; i < sizeof(stream_codec_order); ++i)
     {
-        size_t block_size = (n-offset) > STREAM_BLOCK_MAX_SIZE ? STREAM_BLOCK_MAX_SIZE : (n-offset);
+        const stream_codec_t* codec = &stream_codecs[stream_codec_order[i]];
+        if (codec->decode_cost > job->decode_budget)
+            continue;
+
+        uint8_t slot = best_codec == STREAM_CODEC_STORED ? 0 : best_slot ^ 1;
+        size_t size = codec->compress(src, block_size, scratch + slot * CHUNK_SCRATCH_SIZE, CHUNK_SCRATCH_SIZE);
+        if (size == 0)
+            continue;
+
+        // a codec that is slower to decode has to win by more than a rounding error
+        size_t margin = codec->decode_cost > stream_codecs[best_codec].decode_cost ? (size >> 5) : 0;
+        if (size + margin >= best_size)
+            continue;
+
+        best_codec = stream_codec_order[i];
+        best_size = size;
+        best_slot = slot;
+    }
 
-        size_t compressed_size = fastlz_compress(buffer_get(in, offset), block_size, tempbuf);
-        if (compressed_size < block_size)
-        {
-            stream_block_t block_header;
-            block_header.inlen = u16be(block_size-1);
-            block_header.outlen = u16be((compressed_size-1)|STREAM_BLOCK_COMPRESSED);
+    // only a win is kept, and a win is smaller than the chunk
+    if (best_codec != STREAM_CODEC_STORED)
+        memcpy(job->out + index * STREAM_BLOCK_MAX_SIZE, scratch + best_slot * CHUNK_SCRATCH_SIZE, best_size);
+    free(scratch);
 
-            buffer_add(out, &block_header, sizeof(block_header));
-            buffer_add(out, tempbuf, compressed_size);
-        }
-        else
-        {
-            stream_block_t block_header;
-            block_header.inlen = u16be(block_size-1);
-            block_header.outlen = u16be(block_size-1);
+    job->codecs[index] = best_codec;
+    job->sizes[index] = best_size;
+}
+
+static void compress_buffer(buffer_t* out, const buffer_t* in, uint32_t decode_budget, size_t* usage)
+{
+    size_t n = buffer_count(in);
+    size_t chunks = (n + STREAM_BLOCK_MAX_SIZE - 1) / STREAM_BLOCK_MAX_SIZE;
+
+    // chunks are independent, so compress all of them concurrently and then emit them in order
+    compress_job_t job;
+    job.in = in;
+    job.decode_budget = decode_budget;
+    job.out = malloc(chunks * STREAM_BLOCK_MAX_SIZE);
+    job.sizes = malloc(chunks * sizeof(size_t));
+    job.codecs = malloc(chunks);
+
+    jobs_run(compress_chunk, &job, chunks);
+
+    // no chunk comes out larger than stored
+    buffer_reserve(out, chunks * sizeof(stream_block_t) + n);
+
+    for (size_t i = 0, offset = 0; i < chunks; ++i)
+    {
+        size_t block_size = (n-offset) > STREAM_BLOCK_MAX_SIZE ? STREAM_BLOCK_MAX_SIZE : (n-offset);
+        uint8_t codec = job.codecs[i];
+
+        stream_block_t block_header;
+        block_header.inlen = u16be(block_size-1);
+        block_header.outlen = u16be(job.sizes[i]-1);
+        block_header.codec = codec;
+        block_header.reserved = 0;
 
-            buffer_add(out, &block_header, sizeof(block_header));
+        buffer_add(out, &block_header, sizeof(block_header));
+        if (codec == STREAM_CODEC_STORED)
             buffer_add(out, buffer_get(in, offset), block_size);
-        }
+        else
+            buffer_add(out, job.out + i * STREAM_BLOCK_MAX_SIZE, job.sizes[i]);
 
+        usage[codec]++;
         offset += block_size;
     }
+
+    free(job.codecs);
+    free(job.sizes);
+    free(job.out);
+}
+
+static void print_codec_usage(const char* section, const size_t* usage)
+{
+    fprintf(stderr, "%s chunks:", section);
+    for (size_t i = 0; i < STREAM_CODEC_COUNT; ++i)
+    {
+        if (usage[i])
+            fprintf(stderr, " %s x%lu", stream_codecs[i].name, usage[i]);
+    }
+    fprintf(stderr, "\n");
 }
 
 static void write_buffer(const char* filename, const buffer_t* in)
 {
 	FILE* out = fopen(filename, "wb");
-	fwrite(buffer_get(in, 0), 1, buffer_count(in), out);
+	// the dictionary sections stay empty with the tile cache
+	if (buffer_count(in))
+		fwrite(buffer_get(in, 0), 1, buffer_count(in), out);
 	fclose(out);
 }
 
@@ -84,45 +232,123 @@ int stream_save(const stream_t* stream, FILE* out)
 	buffer_t outbuf;
 	buffer_init(&outbuf, 1);
 
+	uint32_t flags = stream->flags;
 	uint8_t tile_bits = bits_needed(buffer_count(&(stream->tiles.buffer))) + 3;
 	uint8_t block_bits = bits_needed(buffer_count(&(stream->tiles.blocks.buffer))) + 3;
+	size_t stored_blocks = buffer_count(&(stream->tiles.blocks.buffer));
+	size_t stored_tiles = buffer_count(&(stream->tiles.buffer)) - stream->patched;
+
+/*
+    with the tile cache nothing of the dictionaries is saved up front, it all arrives as uploads ahead of the
+    maps. the header counts are the slots then. patches and metatiles index the whole dictionary, so they are off
+*/
+    cache_t cache;
+    cache_init(&cache, stream->cache_tiles ? stream->cache_tiles : buffer_count(&(stream->tiles.buffer)),
+        stream->cache_blocks ? stream->cache_blocks : stored_blocks);
+    const frames_t* maps = &(stream->frames);
+
+    if (flags & STREAM_FLAG_TILE_CACHE)
+    {
+        flags &= ~(STREAM_FLAG_FRAME_PATCH|STREAM_FLAG_METATILES);
+        if (cache_schedule(&cache, &(stream->frames), &(stream->tiles)) < 0)
+        {
+            cache_release(&cache);
+            buffer_release(&outbuf);
+            return -1;
+        }
+
+        maps = &(cache.maps);
+        tile_bits = bits_needed(cache.tile_slots) + 3;
+        block_bits = bits_needed(cache.block_slots) + 3;
+        stored_blocks = stored_tiles = 0;
+    }
 
     buffer_t block_buffer;
     buffer_init(&block_buffer, 1);
-	blocks_save(&block_buffer, &(stream->tiles.blocks));
+    if (stored_blocks)
+        blocks_save(&block_buffer, &(stream->tiles.blocks));
 
     buffer_t tile_buffer;
     buffer_init(&tile_buffer, 1);
-	tiles_save(&tile_buffer, &(stream->tiles), block_bits);
+	tiles_save(&tile_buffer, &(stream->tiles), stored_tiles, block_bits);
 
     buffer_t frame_buffer;
     buffer_init(&frame_buffer, 1);
-	frames_save(&frame_buffer, &(stream->frames), tile_bits);
+	if (frames_save(&frame_buffer, maps, &(stream->tiles), &(stream->metatiles), (flags & STREAM_FLAG_TILE_CACHE) ? &cache : NULL, stored_tiles, tile_bits, block_bits, flags) < 0)
+    {
+        buffer_release(&frame_buffer);
+        buffer_release(&tile_buffer);
+        buffer_release(&block_buffer);
+        cache_release(&cache);
+        buffer_release(&outbuf);
+        return -1;
+    }
+
+    // only there with STREAM_FLAG_METATILES, between the tiles and the frames
+    buffer_t metatile_buffer;
+    buffer_init(&metatile_buffer, 1);
+    if (flags & STREAM_FLAG_METATILES)
+    {
+        metatiles_save(&metatile_buffer, &(stream->metatiles), tile_bits);
+    }
+
+	size_t block_codecs[STREAM_CODEC_COUNT] = { 0 };
+	size_t tile_codecs[STREAM_CODEC_COUNT] = { 0 };
+	size_t metatile_codecs[STREAM_CODEC_COUNT] = { 0 };
+	size_t frame_codecs[STREAM_CODEC_COUNT] = { 0 };
 
 	size_t blocks_start = buffer_count(&outbuf);
         write_buffer("anim.blocks", &block_buffer);
-    	compress_buffer(&outbuf, &block_buffer);
+    	compress_buffer(&outbuf, &block_buffer, stream->decode_budget, block_codecs);
 	size_t tiles_start = buffer_count(&outbuf);
     	write_buffer("anim.tiles", &tile_buffer);
-	compress_buffer(&outbuf, &tile_buffer);
+	compress_buffer(&outbuf, &tile_buffer, stream->decode_budget, tile_codecs);
+	size_t metatiles_start = buffer_count(&outbuf);
+	compress_buffer(&outbuf, &metatile_buffer, stream->decode_budget, metatile_codecs);
 	size_t frames_start = buffer_count(&outbuf);
     	write_buffer("anim.frames", &frame_buffer);
-	compress_buffer(&outbuf, &frame_buffer);
+	compress_buffer(&outbuf, &frame_buffer, stream->decode_budget, frame_codecs);
 	size_t stream_end = buffer_count(&outbuf);
 
 	fprintf(stderr, "blocks: %lu, (%lu -> %lu bytes)\ntiles: %lu (%lu -> %lu bytes)\nframes: %lu (%lu -> %lu bytes)\n",
-		buffer_count(&(stream->tiles.blocks.buffer)), buffer_count(&block_buffer), tiles_start - blocks_start,
-		buffer_count(&(stream->tiles.buffer)), buffer_count(&tile_buffer), frames_start - tiles_start,
+		stored_blocks, buffer_count(&block_buffer), tiles_start - blocks_start,
+		stored_tiles, buffer_count(&tile_buffer), metatiles_start - tiles_start,
 		buffer_count(&(stream->frames.buffer)), buffer_count(&frame_buffer), stream_end - frames_start);
 
+	print_codec_usage("blocks", block_codecs);
+	print_codec_usage("tiles", tile_codecs);
+	if (flags & STREAM_FLAG_METATILES)
+	{
+		fprintf(stderr, "metatiles: %lu (%lu -> %lu bytes)\n", buffer_count(&(stream->metatiles.buffer)), buffer_count(&metatile_buffer), frames_start - metatiles_start);
+		print_codec_usage("metatiles", metatile_codecs);
+	}
+	print_codec_usage("frames", frame_codecs);
+
+	/*
+	    what a decoder keeps of the dictionaries. one drawing every map before decoding the next can overwrite
+	    the slots in place as decoder_t does, stream_load rebuilds the whole dictionaries from the uploads
+	*/
+	size_t entry_size = (block_bits > 16 ? sizeof(uint32_t) : sizeof(uint16_t)) * TILE_INDEX_COUNT;
+	size_t block_size = sizeof(((block_t*)0)->bits);
+	if (flags & STREAM_FLAG_TILE_CACHE)
+	{
+		size_t whole_entry = (bits_needed(buffer_count(&(stream->tiles.blocks.buffer))) + 3 > 16 ? sizeof(uint32_t) : sizeof(uint16_t)) * TILE_INDEX_COUNT;
+		fprintf(stderr, "tile cache: decoder dictionary memory %lu bytes in slots, %lu for the whole dictionaries\n",
+			cache.block_slots * block_size + cache.tile_slots * entry_size,
+			buffer_count(&(stream->tiles.blocks.buffer)) * block_size + buffer_count(&(stream->tiles.buffer)) * whole_entry);
+	}
+
 	stream_header_t header;
-	header.blocks = u32be(buffer_count(&(stream->tiles.blocks.buffer)));
-	header.tiles = u32be(buffer_count(&(stream->tiles.buffer)));
-	header.frames = u32be(buffer_count(&(stream->frames.buffer)));
-    header.size = u32be(buffer_count(&block_buffer) + buffer_count(&tile_buffer) + buffer_count(&frame_buffer));
+	header.magic = u32be(STREAM_MAGIC);
+	header.blocks = u32be((flags & STREAM_FLAG_TILE_CACHE) ? cache.block_slots : stored_blocks);
+	header.tiles = u32be((flags & STREAM_FLAG_TILE_CACHE) ? cache.tile_slots : stored_tiles);
+	header.frames = u32be(buffer_count(&(stream->frames.buffer)) / stream->frames.planes);
+    header.size = u32be(buffer_count(&block_buffer) + buffer_count(&tile_buffer) + buffer_count(&metatile_buffer) + buffer_count(&frame_buffer));
     header.compressed_size = u32be(stream_end);
     header.tile_bits = u16be(tile_bits);
     header.block_bits = u16be(block_bits);
+    header.flags = u32be(flags);
+    header.planes = u32be(stream->frames.planes);
 
     int ret = 0;
     do
@@ -139,55 +365,115 @@ int stream_save(const stream_t* stream, FILE* out)
 
     buffer_release(&block_buffer);
     buffer_release(&tile_buffer);
+    buffer_release(&metatile_buffer);
     buffer_release(&frame_buffer);
+    cache_release(&cache);
 
     buffer_release(&outbuf);
 
 	return ret < 1 ? -1 : 0;
 }
 
-static int decompress_buffer(buffer_t* out, const buffer_t* in)
+typedef struct stream_chunk_t
+{
+    stream_block_t header;
+    size_t in_offset;
+    size_t out_offset;
+    int result;
+} stream_chunk_t;
+
+// walks the chunk headers once to build the chunk offset table, returns total uncompressed size or -1
+static long index_chunks(buffer_t* chunks, const buffer_t* in)
 {
-    char tempbuf[STREAM_BLOCK_MAX_SIZE];
+    size_t out_offset = 0;
 
     for (size_t offset = 0, n = buffer_count(in); offset < n;)
     {
-        stream_block_t block_header;
+        if (n - offset < sizeof(stream_block_t))
+            return -1;
 
-        memcpy(&block_header, buffer_get(in, offset), sizeof(block_header));
-        block_header.inlen = u16be(block_header.inlen);
-        block_header.outlen = u16be(block_header.outlen);
-        offset += sizeof(block_header);
+        stream_chunk_t* chunk = buffer_alloc(chunks, 1);
 
-        size_t insize = (block_header.outlen & ~STREAM_BLOCK_COMPRESSED) + 1;
-        size_t outsize = block_header.inlen + 1;
+        memcpy(&(chunk->header), buffer_get(in, offset), sizeof(chunk->header));
+        chunk->header.inlen = u16be(chunk->header.inlen);
+        chunk->header.outlen = u16be(chunk->header.outlen);
+        offset += sizeof(chunk->header);
 
-        if (block_header.outlen & STREAM_BLOCK_COMPRESSED)
-        {
-            int ret = fastlz_decompress(buffer_get(in, offset), insize, tempbuf, sizeof(tempbuf));
-
-            if (ret != outsize)
-                return -1;
+        size_t insize = chunk->header.outlen + 1;
+        if (n - offset < insize || chunk->header.codec >= STREAM_CODEC_COUNT)
+            return -1;
 
-            buffer_add(out, tempbuf, outsize);
-        }
-        else
-        {
-            buffer_add(out, buffer_get(in, offset), insize);
-        }
+        chunk->in_offset = offset;
+        chunk->out_offset = out_offset;
+        chunk->result = 0;
 
         offset += insize;
+        out_offset += chunk->header.inlen + 1;
     }
 
-    return 0;
+    return out_offset;
 }
 
-int stream_load(stream_t* stream, FILE* in)
+typedef struct decompress_job_t
+{
+    uint8_t* out; // where the first chunk goes, after whatever out held before
+    const buffer_t* in;
+    const buffer_t* chunks;
+} decompress_job_t;
+
+static void decompress_chunk(void* context, size_t index)
+{
+    decompress_job_t* job = context;
+    stream_chunk_t* chunk = buffer_get(job->chunks, index);
+
+    size_t insize = chunk->header.outlen + 1;
+    size_t outsize = chunk->header.inlen + 1;
+    const uint8_t* src = buffer_get(job->in, chunk->in_offset);
+    uint8_t* dest = job->out + chunk->out_offset;
+
+    int ret = stream_codecs[chunk->header.codec].decompress(src, insize, dest, outsize);
+    chunk->result = (ret >= 0 && (size_t)ret == outsize) ? 0 : -1;
+}
+
+int stream_decompress(buffer_t* out, const buffer_t* in)
+{
+    buffer_t chunks;
+    buffer_init(&chunks, sizeof(stream_chunk_t));
+
+    long size = index_chunks(&chunks, in);
+    if (size < 0)
+    {
+        buffer_release(&chunks);
+        return -1;
+    }
+
+    // every chunk knows its output offset up front, so they can decompress straight into place
+    decompress_job_t job;
+    job.out = buffer_alloc(out, size);
+    job.in = in;
+    job.chunks = &chunks;
+    jobs_run(decompress_chunk, &job, buffer_count(&chunks));
+
+    int ret = 0;
+    for (size_t i = 0, n = buffer_count(&chunks); i < n; ++i)
+    {
+        const stream_chunk_t* chunk = buffer_get(&chunks, i);
+        if (chunk->result < 0)
+            ret = -1;
+    }
+
+    buffer_release(&chunks);
+    return ret;
+}
+
+long stream_open(stream_t* stream, const buffer_t* in, stream_header_t* out, buffer_t* sections)
 {
 	stream_header_t header;
-	if (fread(&header, sizeof(header), 1, in) < 1)
+	if (buffer_count(in) < sizeof(header))
 		return -1;
 
+	memcpy(&header, in->data, sizeof(header));
+	header.magic = u32be(header.magic);
 	header.blocks = u32be(header.blocks);
 	header.tiles = u32be(header.tiles);
 	header.frames = u32be(header.frames);
@@ -195,55 +481,139 @@ int stream_load(stream_t* stream, FILE* in)
 	header.compressed_size = u32be(header.compressed_size);
 	header.tile_bits = u16be(header.tile_bits);
 	header.block_bits = u16be(header.block_bits);
+	header.flags = u32be(header.flags);
+	header.planes = u32be(header.planes);
 
-    fprintf(stderr, "blocks: %u, tiles: %u, frames: %u, size: %u (%u)\ntile bits: %u, block bits: %u\n",
-                    header.blocks,
-                    header.tiles,
-                    header.frames,
-                    header.size,
-                    header.compressed_size,
-                    header.tile_bits,
-                    header.block_bits);
+    if (header.magic != STREAM_MAGIC)
+    {
+        fprintf(stderr, "Not a stream of this format version\n");
+        return -1;
+    }
+
+    if (header.planes < 1 || header.planes > FRAME_MAX_PLANES)
+    {
+        fprintf(stderr, "Unsupported number of bitplanes\n");
+        return -1;
+    }
+
+    // 3 flag bits over at least a bit of index, all of it in 32 bits
+    if (header.tile_bits < 4 || header.tile_bits > 32 || header.block_bits < 4 || header.block_bits > 32)
+    {
+        fprintf(stderr, "Unsupported index widths\n");
+        return -1;
+    }
+
+    int cached = (header.flags & STREAM_FLAG_TILE_CACHE) != 0;
+    if (cached && (header.flags & (STREAM_FLAG_FRAME_PATCH|STREAM_FLAG_METATILES)))
+    {
+        fprintf(stderr, "Patches and metatiles do not go with the tile cache\n");
+        return -1;
+    }
+
+    if (buffer_count(in) - sizeof(header) < header.compressed_size)
+    {
+        fprintf(stderr, "Stream truncated\n");
+        return -1;
+    }
 
     buffer_t inbuf;
     buffer_init(&inbuf, 1);
-    uint8_t* data = buffer_alloc(&inbuf, header.compressed_size);
+    buffer_set(&inbuf, in->data + sizeof(header), header.compressed_size);
 
-    if (fread(data, header.compressed_size, 1, in) < 1)
+    if (stream_decompress(sections, &inbuf) < 0)
     {
-        buffer_release(&inbuf);
+        fprintf(stderr, "Failed to decompress buffer\n");
+        return -1;
     }
 
-    buffer_t temp;
-    buffer_init(&temp, 1);
+    if (buffer_count(sections) != header.size)
+    {
+        fprintf(stderr, "Decompressed buffer size mismatch\n");
+        return -1;
+    }
 
-    if (decompress_buffer(&temp, &inbuf) < 0)
+    /*
+        with the tile cache the counts are slots and the dictionaries are the slots, blank until the uploads
+        write into them. the index widths have to be the ones for the counts, and there cannot be more slots
+        than bytes to upload into them
+    */
+    if (cached && (header.tiles < 1 || header.blocks < 1 || header.tiles > header.size || header.blocks > header.size ||
+        bits_needed(header.tiles) + 3 != header.tile_bits || bits_needed(header.blocks) + 3 != header.block_bits))
     {
-        buffer_release(&temp);
-        buffer_release(&inbuf);
+        fprintf(stderr, "Tile cache slots do not match the index widths\n");
+        return -1;
+    }
 
-        fprintf(stderr, "Failed to decompress buffer\n");
+    long current = blocks_load(sections, 0, cached ? 0 : header.blocks, &(stream->tiles.blocks));
+    if (current >= 0)
+        current = tiles_load(sections, current, cached ? 0 : header.tiles, &(stream->tiles), header.block_bits);
+    if (cached && (header.flags & STREAM_FLAG_SOLID))
+        tiles_reserve_solid(&(stream->tiles));
+    if (cached)
+        tiles_reserve_slots(&(stream->tiles), header.tiles, header.blocks);
+    stream->tiles.blocks.solid = (header.flags & STREAM_FLAG_SOLID) != 0;
+    if (current >= 0 && (header.flags & STREAM_FLAG_METATILES))
+        current = metatiles_load(sections, current, &(stream->metatiles), header.tile_bits);
+
+    if (current < 0)
+    {
+        fprintf(stderr, "Dictionaries do not fit the sections\n");
         return -1;
     }
 
-    if (buffer_count(&temp) != header.size)
+    stream->frames.planes = header.planes;
+    *out = header;
+
+    return current;
+}
+
+int stream_load(stream_t* stream, FILE* in)
+{
+    buffer_t file;
+    buffer_init(&file, 1);
+
+    uint8_t chunk[65536];
+    for (size_t n; (n = fread(chunk, 1, sizeof(chunk), in)) > 0;)
+        buffer_add(&file, chunk, n);
+
+    stream_header_t header;
+    buffer_t temp;
+    buffer_init(&temp, 1);
+
+    long current = stream_open(stream, &file, &header, &temp);
+    buffer_release(&file);
+
+    if (current < 0)
     {
         buffer_release(&temp);
-        buffer_release(&inbuf);
-
-        fprintf(stderr, "Decompressed buffer size mismatch\n");
         return -1;
     }
 
-    size_t current = 0;
-    current = blocks_load(&temp, current, header.blocks, &(stream->tiles.blocks));
-    current = tiles_load(&temp, current, header.tiles, &(stream->tiles), header.block_bits);
-    current = frames_load(&temp, current, header.frames, &(stream->frames), header.tile_bits);
+    fprintf(stderr, "blocks: %u, tiles: %u, frames: %u, planes: %u, size: %u (%u)\ntile bits: %u, block bits: %u, flags: %08x\n",
+                    header.blocks,
+                    header.tiles,
+                    header.frames,
+                    header.planes,
+                    header.size,
+                    header.compressed_size,
+                    header.tile_bits,
+                    header.block_bits,
+                    header.flags);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    current = frames_load(&temp, current, header.frames * header.planes, &(stream->frames), &(stream->tiles), &(stream->metatiles), header.tile_bits, header.block_bits, header.flags);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double elapsed = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0;
+    fprintf(stderr, "decoded %u frame maps in %.2f ms (%.2f us/frame)\n", header.frames, elapsed, header.frames ? (elapsed * 1000.0) / header.frames : 0.0);
 
     buffer_release(&temp);
-    buffer_release(&inbuf);
 
-    if (current != header.size)
+    if (current < 0)
+        return -1;
+
+    if ((size_t)current != header.size)
     {
         fprintf(stderr, "Not all data in buffer consumed\n");
         return -1;
@@ -258,6 +628,7 @@ int stream_dump(FILE* in, const char* basename)
 	if (fread(&header, sizeof(header), 1, in) < 1)
 		return -1;
 
+	header.magic = u32be(header.magic);
 	header.blocks = u32be(header.blocks);
 	header.tiles = u32be(header.tiles);
 	header.frames = u32be(header.frames);
@@ -265,15 +636,31 @@ int stream_dump(FILE* in, const char* basename)
 	header.compressed_size = u32be(header.compressed_size);
 	header.tile_bits = u16be(header.tile_bits);
 	header.block_bits = u16be(header.block_bits);
+	header.flags = u32be(header.flags);
+	header.planes = u32be(header.planes);
+
+    if (header.magic != STREAM_MAGIC)
+    {
+        fprintf(stderr, "Not a stream of this format version\n");
+        return -1;
+    }
 
-    fprintf(stderr, "blocks: %u, tiles: %u, frames: %u, size: %u (%u)\ntile bits: %u, block bits: %u\n",
+    fprintf(stderr, "blocks: %u, tiles: %u, frames: %u, planes: %u, size: %u (%u)\ntile bits: %u, block bits: %u, flags: %08x\n",
                     header.blocks,
                     header.tiles,
                     header.frames,
+                    header.planes,
                     header.size,
                     header.compressed_size,
                     header.tile_bits,
-                    header.block_bits);
+                    header.block_bits,
+                    header.flags);
+
+    if (header.planes < 1 || header.planes > FRAME_MAX_PLANES)
+    {
+        fprintf(stderr, "Unsupported number of bitplanes\n");
+        return -1;
+    }
 
     buffer_t inbuf;
     buffer_init(&inbuf, 1);
@@ -287,7 +674,7 @@ int stream_dump(FILE* in, const char* basename)
     buffer_t temp;
     buffer_init(&temp, 1);
 
-    if (decompress_buffer(&temp, &inbuf) < 0)
+    if (stream_decompress(&temp, &inbuf) < 0)
     {
         buffer_release(&temp);
         buffer_release(&inbuf);
@@ -305,6 +692,10 @@ int stream_dump(FILE* in, const char* basename)
         return -1;
     }
 
+    // with the tile cache the counts are slots, the blocks and tiles all come with the frames
+    size_t stored_blocks = (header.flags & STREAM_FLAG_TILE_CACHE) ? 0 : header.blocks;
+    size_t stored_tiles = (header.flags & STREAM_FLAG_TILE_CACHE) ? 0 : header.tiles;
+
     size_t offset = 0;
     {
         char namebuf[512];
@@ -312,13 +703,13 @@ int stream_dump(FILE* in, const char* basename)
         size_t block_size = (BLOCK_WIDTH / 8) * BLOCK_HEIGHT;
 
         FILE* out = fopen(namebuf, "wb");
-        fwrite(temp.data + offset, block_size, header.blocks, out);
+        fwrite(temp.data + offset, block_size, stored_blocks, out);
 
         fclose(out);
 
-        fprintf(stderr, "written blocks to %s (%lu bytes)\n", namebuf, block_size * header.blocks);
+        fprintf(stderr, "written blocks to %s (%lu bytes)\n", namebuf, block_size * stored_blocks);
 
-        offset += block_size * header.blocks;
+        offset += block_size * stored_blocks;
     }
 
     {
@@ -327,13 +718,35 @@ int stream_dump(FILE* in, const char* basename)
         size_t tile_size = (header.block_bits > 16 ? sizeof(uint32_t) : sizeof(uint16_t)) * TILE_INDEX_COUNT;
 
         FILE* out = fopen(namebuf, "wb");
-        fwrite(temp.data + offset, tile_size, header.tiles, out);
+        fwrite(temp.data + offset, tile_size, stored_tiles, out);
 
         fclose(out);
 
-        fprintf(stderr, "written tiles to %s (%lu bytes)\n", namebuf, tile_size * header.tiles);
+        fprintf(stderr, "written tiles to %s (%lu bytes)\n", namebuf, tile_size * stored_tiles);
 
-        offset += tile_size * header.tiles;
+        offset += tile_size * stored_tiles;
+    }
+
+    uint32_t metatiles = 0;
+    if (header.flags & STREAM_FLAG_METATILES)
+    {
+        char namebuf[512];
+        sprintf(namebuf, "%s.metatiles", basename);
+
+        memcpy(&metatiles, temp.data + offset, sizeof(metatiles));
+        metatiles = u32be(metatiles);
+        offset += sizeof(metatiles);
+
+        size_t metatile_size = (header.tile_bits > 16 ? sizeof(uint32_t) : sizeof(uint16_t)) * METATILE_INDEX_COUNT;
+
+        FILE* out = fopen(namebuf, "wb");
+        fwrite(temp.data + offset, metatile_size, metatiles, out);
+
+        fclose(out);
+
+        fprintf(stderr, "written metatiles to %s (%lu bytes)\n", namebuf, metatile_size * metatiles);
+
+        offset += metatile_size * metatiles;
     }
 
     {
@@ -356,9 +769,13 @@ int stream_dump(FILE* in, const char* basename)
 
         fprintf(out, "anim_blocks       equ     %u\n", header.blocks);
         fprintf(out, "anim_tiles        equ     %u\n", header.tiles);
+        fprintf(out, "anim_tile_slots   equ     %u\n", 1U << (header.tile_bits - 3));
+        fprintf(out, "anim_metatiles    equ     %u\n", metatiles);
         fprintf(out, "anim_frames       equ     %u\n", header.frames);
+        fprintf(out, "anim_planes       equ     %u\n", header.planes);
         fprintf(out, "anim_tile_bits    equ     %u\n", header.tile_bits);
         fprintf(out, "anim_block_bits   equ     %u\n", header.block_bits);
+        fprintf(out, "anim_flags        equ     $%08x\n", header.flags);
 
         fprintf(stderr, "written header to %s\n", namebuf);
 
@@ -374,10 +791,18 @@ int stream_dump(FILE* in, const char* basename)
 
 void stream_destroy(stream_t* stream)
 {
+	metatiles_release(&(stream->metatiles));
 	frames_release(&(stream->frames));
 	tiles_release(&(stream->tiles));
 }
 
+// everything holding tile indices follows a tile rebuild or reorder
+static void remap_tiles(stream_t* stream, const tile_index_t* remaps)
+{
+    frames_remap_tiles(&(stream->frames), remaps);
+    metatiles_remap_tiles(&(stream->metatiles), remaps);
+}
+
 void stream_optimize_blocks(stream_t* stream, size_t passes, size_t max_error)
 {
 /*
@@ -405,27 +830,637 @@ void stream_optimize_tiles(stream_t* stream, size_t max_error)
 
     tile_index_t* remaps = malloc(sizeof(tile_index_t) * buffer_count(&(stream->tiles.buffer)));
     tiles_rebuild(&(stream->tiles), remaps);
-    frames_remap_tiles(&(stream->frames), remaps);
+    remap_tiles(stream, remaps);
     free(remaps);
 }
 
-void stream_optimize_frames(stream_t* stream)
+void stream_optimize_frames(stream_t* stream, size_t max_error)
 {
     fprintf(stderr, "optimizing frames...\n");
+
+    tiles_t* tiles = &(stream->tiles);
+    frames_t* frames = &(stream->frames);
+
 /*
+    keep showing the previous tile at a position when the new one is within max_error bits of it,
+    compared against what is actually on screen so the error never accumulates
+*/
+    size_t reused = 0;
+    for (size_t i = frames->planes, n = buffer_count(&(frames->buffer)); i < n; ++i)
+    {
+        frame_t* curr = buffer_get(&(frames->buffer), i);
+        const frame_t* shown = frames_last(frames, i);
+        for (size_t j = 0; j < FRAME_TILE_COUNT; ++j)
+        {
+            if (curr->tiles[j] != shown->tiles[j] && tiles_diff(tiles, curr->tiles[j], shown->tiles[j]) <= max_error)
+            {
+                curr->tiles[j] = shown->tiles[j];
+                ++reused;
+            }
+        }
+
+        fprintf(stderr, "\rreusing tiles: %lu/%lu, reused: %lu", i + 1, n, reused);
+    }
+    fprintf(stderr, "\n");
+
+    stream_shrink(stream);
+}
 
-idea: identify tiles which are only briefly updated with hardly any difference, and see if they are then
-updated the frame after - allow for some of them to go "missing"
+typedef struct rate_update_t
+{
+    uint32_t position;
+    uint64_t importance;
+} rate_update_t;
+
+static int compare_updates(const void* a, const void* b)
+{
+    const rate_update_t* ua = a;
+    const rate_update_t* ub = b;
 
-- then we can also optimize away all tiles / blocks no longer in use
+    if (ua->importance != ub->importance)
+        return ua->importance > ub->importance ? -1 : 1;
+    return ua->position < ub->position ? -1 : (ua->position > ub->position);
+}
 
+static void apply_updates(frame_t* out, const frame_t* shown, const frame_t* desired, const rate_update_t* updates, size_t count)
+{
+    *out = *shown;
+    for (size_t i = 0; i < count; ++i)
+        out->tiles[updates[i].position] = desired->tiles[updates[i].position];
+}
+
+static int rate_over(const frame_cost_t* cost, size_t max_bytes, uint64_t max_cycles)
+{
+    return (max_bytes && cost->bytes > max_bytes) || (max_cycles && cost->cycles > max_cycles);
+}
+
+void stream_rate_control(stream_t* stream, size_t max_updates, size_t max_bytes, uint64_t max_cycles)
+{
+    if (!max_updates && !max_bytes && !max_cycles)
+        return;
+
+    fprintf(stderr, "rate control (max %lu updates, %lu bytes, %lu cycles per frame)...\n", max_updates, max_bytes, (unsigned long)max_cycles);
+
+    tiles_t* tiles = &(stream->tiles);
+    frames_t* frames = &(stream->frames);
+    size_t tile_bits = bits_needed(buffer_count(&(tiles->buffer))) + 3;
+    size_t block_bits = bits_needed(buffer_count(&(tiles->blocks.buffer))) + 3;
+    int budgeted = max_bytes || max_cycles;
+
+    size_t bound = 0, deferred = 0, substituted = 0, over = 0;
+    size_t oldest = 0, worst_error = 0;
+
+    // budgets are per frame, each plane map gets its share
+    size_t planes = frames->planes;
+    max_updates = max_updates ? (max_updates + planes - 1) / planes : 0;
+    max_bytes = max_bytes ? (max_bytes + planes - 1) / planes : 0;
+    max_cycles = max_cycles ? (max_cycles + planes - 1) / planes : 0;
+
+    uint32_t ages[FRAME_MAX_PLANES][FRAME_TILE_COUNT];
+    memset(ages, 0, sizeof(ages));
+
+    for (size_t i = 0, n = buffer_count(&(frames->buffer)); i < n; ++i)
+    {
+        frame_t* curr = buffer_get(&(frames->buffer), i);
+        frame_t desired = *curr;
+        frame_t shown = *frames_last(frames, i);
+        uint32_t* age = ages[i % planes];
+
+/*
+    rank the updates by how wrong the screen stays without them, weighted by how long they have been
+    waiting already. positions with nothing on screen yet can never be deferred
 */
+        rate_update_t updates[FRAME_TILE_COUNT];
+        size_t count = 0, forced = 0;
+
+        for (size_t j = 0; j < FRAME_TILE_COUNT; ++j)
+        {
+            if (desired.tiles[j] == shown.tiles[j])
+            {
+                age[j] = 0;
+                continue;
+            }
+
+            rate_update_t* update = &updates[count++];
+            update->position = j;
+
+            if (shown.tiles[j] == NO_TILE)
+            {
+                update->importance = UINT64_MAX;
+                ++forced;
+            }
+            else
+            {
+                update->importance = (uint64_t)(tiles_diff(tiles, desired.tiles[j], shown.tiles[j]) + 1) * (age[j] + 1);
+            }
+        }
+
+        qsort(updates, count, sizeof(rate_update_t), compare_updates);
+
+        size_t keep = count;
+        if (max_updates && keep > max_updates)
+            keep = max_updates > forced ? max_updates : forced;
+
+        frame_t candidate;
+        apply_updates(&candidate, &shown, &desired, updates, keep);
+
+        // shrink by whichever of the byte and cycle budgets is overshot the most
+        frame_cost_t cost;
+        memset(&cost, 0, sizeof(cost));
+        if (budgeted)
+            cost_frame(&cost, &(stream->cost), tiles, &shown, &candidate, tile_bits, block_bits, stream->flags);
+
+        while (rate_over(&cost, max_bytes, max_cycles) && keep > forced)
+        {
+            size_t next = keep;
+            if (max_bytes && cost.bytes > max_bytes)
+                next = (keep * max_bytes) / cost.bytes;
+            if (max_cycles && cost.cycles > max_cycles && (keep * max_cycles) / cost.cycles < next)
+                next = (keep * max_cycles) / cost.cycles;
+            keep = next < keep ? (next > forced ? next : forced) : keep - 1;
+
+            apply_updates(&candidate, &shown, &desired, updates, keep);
+            cost_frame(&cost, &(stream->cost), tiles, &shown, &candidate, tile_bits, block_bits, stream->flags);
+        }
+
+        if (rate_over(&cost, max_bytes, max_cycles))
+            ++over;
+
+        if (keep < count)
+        {
+            ++bound;
+
+            // a deferred position can still show a closer tile that is already on screen next to it, coded as a left / above op
+            size_t substitutions = 0;
+            if (stream->flags & STREAM_FLAG_FRAME_OPS)
+            {
+                frame_t substitute = candidate;
+                for (size_t k = keep; k < count && (!max_updates || keep + substitutions < max_updates); ++k)
+                {
+                    uint32_t p = updates[k].position;
+                    size_t stale = tiles_diff(tiles, desired.tiles[p], shown.tiles[p]);
+
+                    tile_index_t neighbours[2] = { NO_TILE, NO_TILE };
+                    if (p % FRAME_TILES_X)
+                        neighbours[0] = substitute.tiles[p - 1];
+                    if (p >= FRAME_TILES_X)
+                        neighbours[1] = substitute.tiles[p - FRAME_TILES_X];
+
+                    for (size_t l = 0; l < 2; ++l)
+                    {
+                        if (neighbours[l] == NO_TILE || neighbours[l] == shown.tiles[p])
+                            continue;
+
+                        size_t diff = tiles_diff(tiles, desired.tiles[p], neighbours[l]);
+                        if (diff < stale)
+                        {
+                            substitute.tiles[p] = neighbours[l];
+                            stale = diff;
+                        }
+                    }
+
+                    if (substitute.tiles[p] != candidate.tiles[p])
+                        ++substitutions;
+                }
+
+                frame_cost_t substitute_cost;
+                memset(&substitute_cost, 0, sizeof(substitute_cost));
+                if (substitutions && budgeted)
+                    cost_frame(&substitute_cost, &(stream->cost), tiles, &shown, &substitute, tile_bits, block_bits, stream->flags);
+
+                if (substitutions && !rate_over(&substitute_cost, max_bytes, max_cycles))
+                    candidate = substitute;
+                else
+                    substitutions = 0;
+            }
+
+            substituted += substitutions;
+        }
+
+        for (size_t k = 0; k < count; ++k)
+        {
+            uint32_t p = updates[k].position;
+            if (candidate.tiles[p] != shown.tiles[p])
+            {
+                age[p] = 0;
+                continue;
+            }
+
+            ++deferred;
+            age[p]++;
+            oldest = age[p] > oldest ? age[p] : oldest;
+
+            size_t error = tiles_diff(tiles, desired.tiles[p], shown.tiles[p]);
+            worst_error = error > worst_error ? error : worst_error;
+        }
+
+        *curr = candidate;
+
+        fprintf(stderr, "\rrate control: %lu/%lu, bound: %lu", i + 1, n, bound);
+    }
+    fprintf(stderr, "\n");
+
+    fprintf(stderr, "budget bound in %lu frames, deferred %lu updates (oldest %lu frames, worst error %lu bits), substituted %lu, %lu frames over budget from forced updates\n",
+        bound, deferred, oldest, worst_error, substituted, over);
+
+    stream_shrink(stream);
 }
 
+int stream_cost_report(const stream_t* stream, uint64_t max_cycles, FILE* fp)
+{
+    const tiles_t* tiles = &(stream->tiles);
+    const frames_t* frames = &(stream->frames);
+    size_t tile_bits = bits_needed(buffer_count(&(tiles->buffer))) + 3;
+    size_t block_bits = bits_needed(buffer_count(&(tiles->blocks.buffer))) + 3;
+
+    if (!max_cycles)
+        max_cycles = COST_FRAME_BUDGET;
+
+    fprintf(fp, "frame,plane,cycles,bytes,runs,literals,tiles,blits,cpu_blocks,fills,fetch_bytes\n");
+
+    uint64_t total = 0, worst = 0, cycles = 0;
+    size_t worst_frame = 0, over = 0, cpu_blocks = 0, blocks = 0;
+
+    // a frame costs all of its planes
+    for (size_t i = 0, n = buffer_count(&(frames->buffer)); i < n; ++i)
+    {
+        const frame_t* curr = buffer_get(&(frames->buffer), i);
+        const frame_t* last = frames_last(frames, i);
+        size_t frame = i / frames->planes, plane = i % frames->planes;
+
+        frame_cost_t cost;
+        cost_frame(&cost, &(stream->cost), tiles, last, curr, tile_bits, block_bits, stream->flags);
+
+        fprintf(fp, "%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu\n", frame, plane, (unsigned long)cost.cycles, cost.bytes, cost.runs,
+            cost.literals, cost.tiles, cost.blits, cost.cpu_blocks, cost.fills, cost.fetch_bytes);
+
+        cpu_blocks += cost.cpu_blocks;
+        blocks += cost.blits + cost.cpu_blocks;
+
+        cycles = plane ? cycles + cost.cycles : cost.cycles;
+        if (plane + 1 < frames->planes)
+            continue;
+
+        total += cycles;
+        if (cycles > worst)
+        {
+            worst = cycles;
+            worst_frame = frame;
+        }
+        if (cycles > max_cycles)
+            ++over;
+    }
+
+    size_t n = buffer_count(&(frames->buffer)) / frames->planes;
+    fprintf(stderr, "decode cost: mean %lu cycles, worst %lu (frame %lu), %lu/%lu frames over %lu, %lu%% of blocks drawn by the cpu\n",
+        n ? (unsigned long)(total / n) : 0, (unsigned long)worst, worst_frame, over, n, (unsigned long)max_cycles,
+        blocks ? (cpu_blocks * 100) / blocks : 0);
+
+    return ferror(fp) ? -1 : 0;
+}
+
+typedef struct order_key_t
+{
+    uint64_t key;
+    uint32_t index;
+} order_key_t;
+
+static int compare_order_keys(const void* a, const void* b)
+{
+    const order_key_t* ka = a;
+    const order_key_t* kb = b;
+
+    if (ka->key != kb->key)
+        return ka->key < kb->key ? -1 : 1;
+    return ka->index < kb->index ? -1 : (ka->index > kb->index);
+}
+
+// the first pinned entries keep their place, for the reserved solid block / tile
+static void sort_order(order_key_t* keys, size_t count, size_t pinned, uint32_t* order)
+{
+    qsort(keys + pinned, count - pinned, sizeof(order_key_t), compare_order_keys);
+    for (size_t i = 0; i < count; ++i)
+        order[i] = keys[i].index;
+}
+
+// mean dictionary distance between consecutive tile / block fetches during playback
+static void report_locality(const stream_t* stream, const char* label)
+{
+    const tiles_t* tiles = &(stream->tiles);
+
+    uint64_t tile_distance = 0, block_distance = 0;
+    uint64_t tile_fetches = 0, block_fetches = 0;
+    uint32_t last_tile = 0, last_block = 0;
+
+    for (size_t i = 0, n = buffer_count(&(stream->frames.buffer)); i < n; ++i)
+    {
+        const frame_t* curr = buffer_get(&(stream->frames.buffer), i);
+        const frame_t* last = frames_last(&(stream->frames), i);
+        for (size_t j = 0; j < FRAME_TILE_COUNT; ++j)
+        {
+            if (curr->tiles[j] == last->tiles[j])
+                continue;
+
+            uint32_t ti = curr->tiles[j] & ~TILE_BITS_MASK;
+            tile_distance += ti > last_tile ? ti - last_tile : last_tile - ti;
+            last_tile = ti;
+            ++tile_fetches;
+
+            const tile_t* tile = buffer_get(&(tiles->buffer), ti);
+            for (size_t k = 0; k < TILE_INDEX_COUNT; ++k)
+            {
+                uint32_t bi = tile->indices[k] & ~BLOCK_BITS_MASK;
+                block_distance += bi > last_block ? bi - last_block : last_block - bi;
+                last_block = bi;
+                ++block_fetches;
+            }
+        }
+    }
+
+    fprintf(stderr, "%s: %lu tile fetches, mean tile distance %.1f, mean block distance %.1f\n", label, tile_fetches,
+        tile_fetches ? (double)tile_distance / tile_fetches : 0.0,
+        block_fetches ? (double)block_distance / block_fetches : 0.0);
+}
+
+void stream_reorder(stream_t* stream, uint32_t order)
+{
+    if (order == STREAM_ORDER_NONE)
+        return;
+
+    fprintf(stderr, "reordering dictionaries by %s...\n", order == STREAM_ORDER_FIRST_USE ? "first use" : "frequency");
+    stream->patched = 0;
+    report_locality(stream, "before");
+
+    tiles_t* tiles = &(stream->tiles);
+    frames_t* frames = &(stream->frames);
+    size_t tile_count = buffer_count(&(tiles->buffer));
+    size_t block_count = buffer_count(&(tiles->blocks.buffer));
+    size_t pinned = tiles->blocks.solid ? 1 : 0;
+
+    // tiles: keyed by the position of their first literal reference, or by how often they are referenced
+    {
+        order_key_t* keys = malloc(sizeof(order_key_t) * tile_count);
+        for (size_t i = 0; i < tile_count; ++i)
+        {
+            keys[i].key = order == STREAM_ORDER_FIRST_USE ? UINT64_MAX : 0;
+            keys[i].index = i;
+        }
+
+        uint64_t fetch = 0;
+        for (size_t i = 0, n = buffer_count(&(frames->buffer)); i < n; ++i)
+        {
+            const frame_t* curr = buffer_get(&(frames->buffer), i);
+            const frame_t* last = frames_last(frames, i);
+            for (size_t j = 0; j < FRAME_TILE_COUNT; ++j)
+            {
+                if (curr->tiles[j] == last->tiles[j])
+                    continue;
+
+                order_key_t* key = &keys[curr->tiles[j] & ~TILE_BITS_MASK];
+                if (order == STREAM_ORDER_FIRST_USE)
+                    key->key = key->key == UINT64_MAX ? fetch : key->key;
+                else
+                    key->key--;
+                ++fetch;
+            }
+        }
+
+        uint32_t* tile_order = malloc(sizeof(uint32_t) * tile_count);
+        tile_index_t* remaps = malloc(sizeof(tile_index_t) * tile_count);
+
+        sort_order(keys, tile_count, pinned, tile_order);
+        tiles_reorder(tiles, tile_order, remaps);
+        remap_tiles(stream, remaps);
+
+        free(remaps);
+        free(tile_order);
+        free(keys);
+    }
+
+    // blocks: same keys, taken over the blocks of every fetched tile in playback order
+    {
+        order_key_t* keys = malloc(sizeof(order_key_t) * block_count);
+        for (size_t i = 0; i < block_count; ++i)
+        {
+            keys[i].key = order == STREAM_ORDER_FIRST_USE ? UINT64_MAX : 0;
+            keys[i].index = i;
+        }
+
+        uint64_t fetch = 0;
+        for (size_t i = 0, n = buffer_count(&(frames->buffer)); i < n; ++i)
+        {
+            const frame_t* curr = buffer_get(&(frames->buffer), i);
+            const frame_t* last = frames_last(frames, i);
+            for (size_t j = 0; j < FRAME_TILE_COUNT; ++j)
+            {
+                if (curr->tiles[j] == last->tiles[j])
+                    continue;
+
+                const tile_t* tile = buffer_get(&(tiles->buffer), curr->tiles[j] & ~TILE_BITS_MASK);
+                for (size_t k = 0; k < TILE_INDEX_COUNT; ++k)
+                {
+                    order_key_t* key = &keys[tile->indices[k] & ~BLOCK_BITS_MASK];
+                    if (order == STREAM_ORDER_FIRST_USE)
+                        key->key = key->key == UINT64_MAX ? fetch : key->key;
+                    else
+                        key->key--;
+                    ++fetch;
+                }
+            }
+        }
+
+        uint32_t* block_order = malloc(sizeof(uint32_t) * block_count);
+        block_index_t* remaps = malloc(sizeof(block_index_t) * block_count);
+
+        sort_order(keys, block_count, pinned, block_order);
+        blocks_reorder(&(tiles->blocks), block_order, remaps);
+        tiles_remap_blocks(tiles, remaps);
+
+        free(remaps);
+        free(block_order);
+        free(keys);
+    }
+
+    report_locality(stream, "after");
+}
+
+void stream_patch_tiles(stream_t* stream)
+{
+    stream->patched = 0;
+
+    // metatiles cannot hold tiles the decoder builds later, build them again afterwards
+    metatiles_release(&(stream->metatiles));
+    metatiles_init(&(stream->metatiles));
+
+    // patched tiles are appended to the whole dictionary, the tile cache has none
+    if (stream->flags & STREAM_FLAG_TILE_CACHE)
+        return;
+
+    if ((stream->flags & (STREAM_FLAG_FRAME_PATCH|STREAM_FLAG_FRAME_OPS)) != (STREAM_FLAG_FRAME_PATCH|STREAM_FLAG_FRAME_OPS))
+        return;
+
+    tiles_t* tiles = &(stream->tiles);
+    frames_t* frames = &(stream->frames);
+    size_t tile_count = buffer_count(&(tiles->buffer));
+    size_t block_bits = bits_needed(buffer_count(&(tiles->blocks.buffer))) + 3;
+    size_t tile_bits = bits_needed(tile_count) + 3;
+
+/*
+    a tile whose first appearance is unflipped over a tile it differs from in a single block can be built by the
+    decoder from a patch. a patch is 2 + block_bits bits against tile_bits for a literal plus the stored entry, so
+    take it whenever it is smaller. those tiles move to the end in first use order, which is the order the decoder
+    appends them in
+*/
+    size_t entry_bits = (block_bits > 16 ? 32 : 16) * TILE_INDEX_COUNT;
+    if (2 + block_bits >= tile_bits + entry_bits)
+        return;
+
+    uint8_t* seen = calloc(tile_count, sizeof(uint8_t));
+    uint8_t* patch = calloc(tile_count, sizeof(uint8_t));
+    uint32_t* patches = malloc(sizeof(uint32_t) * tile_count);
+    size_t patched = 0;
+
+    for (size_t i = 0, n = buffer_count(&(frames->buffer)); i < n; ++i)
+    {
+        const frame_t* curr = buffer_get(&(frames->buffer), i);
+        const frame_t* last = frames_last(frames, i);
+        for (size_t j = 0; j < FRAME_TILE_COUNT; ++j)
+        {
+            tile_index_t ti = curr->tiles[j];
+            uint32_t index = ti & ~TILE_BITS_MASK;
+            if (seen[index])
+                continue;
+            seen[index] = 1;
+
+            if (last->tiles[j] == NO_TILE || (tiles->blocks.solid && index == TILE_SOLID))
+                continue;
+
+            if (tiles_patch_slot(tiles, last->tiles[j], ti) < 0)
+                continue;
+
+            patch[index] = 1;
+            patches[patched++] = index;
+        }
+    }
+
+    // stored tiles keep their order
+    uint32_t* order = malloc(sizeof(uint32_t) * tile_count);
+    size_t k = 0;
+    for (size_t i = 0; i < tile_count; ++i)
+    {
+        if (!patch[i])
+            order[k++] = i;
+    }
+    memcpy(order + k, patches, sizeof(uint32_t) * patched);
+
+    tile_index_t* remaps = malloc(sizeof(tile_index_t) * tile_count);
+    tiles_reorder(tiles, order, remaps);
+    remap_tiles(stream, remaps);
+    stream->patched = patched;
+
+    fprintf(stderr, "patching: %lu of %lu tiles rebuilt from block patches, %lu dictionary bytes saved\n",
+        patched, tile_count, patched * entry_bits / 8);
+
+    free(remaps);
+    free(order);
+    free(patches);
+    free(patch);
+    free(seen);
+}
+
+void stream_build_metatiles(stream_t* stream, size_t min_uses)
+{
+    metatiles_release(&(stream->metatiles));
+    metatiles_init(&(stream->metatiles));
+
+    if (!(stream->flags & STREAM_FLAG_METATILES) || (stream->flags & STREAM_FLAG_TILE_CACHE))
+        return;
+
+    size_t stored = buffer_count(&(stream->tiles.buffer)) - stream->patched;
+    frames_build_metatiles(&(stream->frames), &(stream->metatiles), stored, min_uses);
+}
+
+void stream_merge(stream_t* stream, const stream_t* other)
+{
+    size_t blocks = buffer_count(&(stream->tiles.blocks.buffer)), tiles = buffer_count(&(stream->tiles.buffer));
+    size_t count = buffer_count(&(other->tiles.buffer));
+
+    tile_index_t* remaps = malloc(sizeof(tile_index_t) * (count ? count : 1));
+    tiles_merge(&(stream->tiles), &(other->tiles), remaps);
+
+    for (size_t i = 0, n = buffer_count(&(other->frames.buffer)); i < n; ++i)
+    {
+        const frame_t* in = buffer_get(&(other->frames.buffer), i);
+
+        frame_t frame;
+        for (size_t j = 0; j < FRAME_TILE_COUNT; ++j)
+            frame.tiles[j] = remaps[in->tiles[j] & ~TILE_BITS_MASK] ^ (in->tiles[j] & TILE_BITS_MASK);
+        frames_add(&(stream->frames), &frame);
+    }
+
+    free(remaps);
+
+    fprintf(stderr, "merged %lu blocks and %lu tiles, %lu and %lu of them new\n",
+        buffer_count(&(other->tiles.blocks.buffer)), count,
+        buffer_count(&(stream->tiles.blocks.buffer)) - blocks, buffer_count(&(stream->tiles.buffer)) - tiles);
+}
 
 void stream_shrink(stream_t* stream)
 {
 /*
 shrink blocks and tiles while remapping users to remove dead space
 */
+    tiles_t* tiles = &(stream->tiles);
+    stream->patched = 0;
+    frames_t* frames = &(stream->frames);
+
+    // drop tiles no frame references any more, then blocks no tile references
+    for (size_t i = 0, n = buffer_count(&(tiles->buffer)); i < n; ++i)
+    {
+        tile_t* tile = buffer_get(&(tiles->buffer), i);
+        tile->count = 0;
+        tile->remap = NO_TILE;
+    }
+
+    for (size_t i = 0, n = buffer_count(&(frames->buffer)); i < n; ++i)
+    {
+        const frame_t* curr = buffer_get(&(frames->buffer), i);
+        for (size_t j = 0; j < FRAME_TILE_COUNT; ++j)
+        {
+            tile_t* tile = buffer_get(&(tiles->buffer), curr->tiles[j] & ~TILE_BITS_MASK);
+            tile->count++;
+        }
+    }
+
+    size_t old_tiles = buffer_count(&(tiles->buffer));
+    tile_index_t* tile_remaps = malloc(sizeof(tile_index_t) * old_tiles);
+    tiles_rebuild(tiles, tile_remaps);
+    remap_tiles(stream, tile_remaps);
+    free(tile_remaps);
+
+    for (size_t i = 0, n = buffer_count(&(tiles->blocks.buffer)); i < n; ++i)
+    {
+        block_t* block = buffer_get(&(tiles->blocks.buffer), i);
+        block->count = 0;
+        block->remap = NO_BLOCK;
+    }
+
+    for (size_t i = 0, n = buffer_count(&(tiles->buffer)); i < n; ++i)
+    {
+        const tile_t* tile = buffer_get(&(tiles->buffer), i);
+        for (size_t j = 0; j < TILE_INDEX_COUNT; ++j)
+        {
+            block_t* block = buffer_get(&(tiles->blocks.buffer), tile->indices[j] & ~BLOCK_BITS_MASK);
+            block->count++;
+        }
+    }
+
+    size_t old_blocks = buffer_count(&(tiles->blocks.buffer));
+    block_index_t* block_remaps = malloc(sizeof(block_index_t) * old_blocks);
+    blocks_rebuild(&(tiles->blocks), block_remaps);
+    tiles_remap_blocks(tiles, block_remaps);
+    free(block_remaps);
+
+    fprintf(stderr, "dropped %lu unused tiles and %lu unused blocks\n",
+        old_tiles - buffer_count(&(tiles->buffer)), old_blocks - buffer_count(&(tiles->blocks.buffer)));
 }
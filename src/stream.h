@@ -5,9 +5,14 @@
 
 #include "frames.h"
 #include "tiles.h"
+#include "cost.h"
+
+// first word of a stream, the low byte is the format version
+#define STREAM_MAGIC (0x414e4d01)
 
 typedef struct stream_header_t
 {
+	uint32_t magic; // STREAM_MAGIC
 	uint32_t blocks;
 	uint32_t tiles;
 	uint32_t frames;
@@ -16,20 +21,53 @@ typedef struct stream_header_t
 
 	uint16_t tile_bits;
 	uint16_t block_bits;
+
+	uint32_t flags; // STREAM_FLAG_*
+	uint32_t planes; // bitplanes, a frame has a map for each
 } stream_header_t;
 
+#define STREAM_FLAG_HUFFMAN_FRAMES (1 << 0) // frame maps are canonical huffman coded
+#define STREAM_FLAG_FRAME_OPS (1 << 1) // frame maps use op runs (copy / above / left) instead of skip / literal runs
+#define STREAM_FLAG_SOLID (1 << 2) // block 0 and tile 0 are reserved solid black (white when inverted), players may fill them
+#define STREAM_FLAG_FRAME_REPEAT (1 << 3) // frame headers can repeat the previous frame or reference an earlier map
+#define STREAM_FLAG_FRAME_PATCH (1 << 4) // frame maps can patch one block of the shown tile, the decoder appends the result to the tiles
+#define STREAM_FLAG_METATILES (1 << 5) // a dictionary of 2x2 tile groups follows the tiles, frame maps can place them before the tile runs
+#define STREAM_FLAG_TILE_CACHE (1 << 6) // blocks and tiles are uploaded into a fixed number of slots ahead of the frame maps that need them
+
+// relative decode cost of each chunk codec, used as the encoder's decode-speed budget
+#define STREAM_DECODE_COST_COPY (0)
+#define STREAM_DECODE_COST_LZ (1)
+#define STREAM_DECODE_COST_FASTLZ (2)
+#define STREAM_DECODE_COST_ENTROPY (4)
+
 typedef struct stream_t
 {
 	frames_t frames;
 	tiles_t tiles;
+	metatiles_t metatiles; // set by stream_build_metatiles
+
+	uint32_t flags; // STREAM_FLAG_* to encode with
+	uint32_t decode_budget; // highest STREAM_DECODE_COST_* a chunk codec may have
+	cost_model_t cost; // target decode cost, for rate control and the cost report
+	size_t patched; // trailing tiles rebuilt from patches instead of saved, set by stream_patch_tiles
+	size_t cache_tiles; // tile slots with STREAM_FLAG_TILE_CACHE
+	size_t cache_blocks; // block slots with STREAM_FLAG_TILE_CACHE
 } stream_t;
 
-#define STREAM_BLOCK_COMPRESSED (1 << 15)
+#define STREAM_CODEC_STORED (0)
+#define STREAM_CODEC_FASTLZ1 (1)
+#define STREAM_CODEC_FASTLZ2 (2)
+#define STREAM_CODEC_LZ (3)
+#define STREAM_CODEC_RANS (4)
+#define STREAM_CODEC_COUNT (5)
+
 #define STREAM_BLOCK_MAX_SIZE (32768)
 typedef struct stream_block_t
 {
     uint16_t inlen; // uncompressed
     uint16_t outlen; // potentially compressed
+    uint8_t codec; // STREAM_CODEC_*
+    uint8_t reserved;
 } stream_block_t;
 
 stream_t* stream_create();
@@ -37,10 +75,27 @@ void stream_destroy(stream_t* stream);
 
 int stream_save(const stream_t* stream, FILE* fp);
 int stream_load(stream_t* stream, FILE* fp);
+// header and dictionaries of a stream in memory, the frame maps are left in sections from the returned offset, -1 on errors
+long stream_open(stream_t* stream, const buffer_t* in, stream_header_t* header, buffer_t* sections);
+// the chunked sections following the header, appended to out. -1 when a chunk fails
+int stream_decompress(buffer_t* out, const buffer_t* in);
 
 void stream_optimize_blocks(stream_t* stream, size_t passes, size_t max_error);
 void stream_optimize_tiles(stream_t* stream, size_t max_error);
-void stream_optimize_frames(stream_t* stream);
+void stream_optimize_frames(stream_t* stream, size_t max_error);
+void stream_rate_control(stream_t* stream, size_t max_updates, size_t max_bytes, uint64_t max_cycles);
+int stream_cost_report(const stream_t* stream, uint64_t max_cycles, FILE* fp);
+void stream_shrink(stream_t* stream);
+// appends the frames of other, its tiles and blocks are merged into the dictionary, before patches and metatiles
+void stream_merge(stream_t* stream, const stream_t* other);
+
+#define STREAM_ORDER_NONE (0)
+#define STREAM_ORDER_FIRST_USE (1) // dictionaries in playback order, for sequential streaming
+#define STREAM_ORDER_FREQUENCY (2) // most referenced first, for small ids
+void stream_reorder(stream_t* stream, uint32_t order);
+void stream_patch_tiles(stream_t* stream);
+// after stream_patch_tiles, which clears them
+void stream_build_metatiles(stream_t* stream, size_t min_uses);
 
 int stream_dump(FILE* fp, const char* basename);
 
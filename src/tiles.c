@@ -42,6 +42,8 @@ void tiles_init(tiles_t* tiles)
 
 	for (size_t i = 0; i < TILES_HASH_SIZE; ++i)
 		tiles->hash[i] = NO_TILE;
+
+	tiles->variants = BLOCK_VARIANTS_ALL;
 }
 
 void tiles_release(tiles_t* tiles)
@@ -50,6 +52,35 @@ void tiles_release(tiles_t* tiles)
 	buffer_release(&(tiles->buffer));
 }
 
+// must be called on empty dictionaries, reserves BLOCK_SOLID and TILE_SOLID
+void tiles_reserve_solid(tiles_t* tiles)
+{
+	blocks_reserve_solid(&(tiles->blocks));
+
+	tile_t* out = buffer_alloc(&(tiles->buffer), 1);
+	for (size_t i = 0; i < TILE_INDEX_COUNT; ++i)
+		out->indices[i] = BLOCK_SOLID;
+
+	uint32_t hash = hash_tile(tiles, out) & (TILES_HASH_SIZE-1);
+	out->next = tiles->hash[hash];
+	tiles->hash[hash] = TILE_SOLID;
+
+	out->count = 0;
+	out->remap = NO_TILE;
+}
+
+// blank entries up to count tiles and blocks, outside the hash chains. STREAM_FLAG_TILE_CACHE slots are overwritten in place
+void tiles_reserve_slots(tiles_t* tiles, size_t count, size_t blocks)
+{
+	size_t have = buffer_count(&(tiles->blocks.buffer));
+	if (blocks > have)
+		memset(buffer_alloc(&(tiles->blocks.buffer), blocks - have), 0, sizeof(block_t) * (blocks - have));
+
+	have = buffer_count(&(tiles->buffer));
+	if (count > have)
+		memset(buffer_alloc(&(tiles->buffer), count - have), 0, sizeof(tile_t) * (count - have));
+}
+
 static tile_t tile_flip_x(const tile_t* in)
 {
 	tile_t out;
@@ -127,7 +158,7 @@ int tile_match(const tiles_t* tiles, const tile_t* a, const tile_t* b)
 
 tile_index_t tiles_match(tiles_t* tiles, const tile_t* tile)
 {
-	for (size_t i = 0; i < sizeof_array(tile_variants); ++i)
+	for (size_t i = 0; i < tiles->variants; ++i)
 	{
 		uint32_t variant = tile_variants[i];
 
@@ -162,6 +193,48 @@ tile_index_t tiles_match(tiles_t* tiles, const tile_t* tile)
 	return NO_BLOCK;
 }
 
+// the tile made of the blocks in temp, found or appended, with its count raised by one
+static tile_index_t tiles_insert_indices(tiles_t* tiles, const tile_t* temp)
+{
+	// four solid blocks of the same colour skip the tile lookup as well
+	if (tiles->blocks.solid)
+	{
+		size_t solid = 0;
+		for (size_t i = 0; i < TILE_INDEX_COUNT; ++i)
+			solid += temp->indices[i] == temp->indices[0] && (temp->indices[i] & ~BLOCK_BITS_MASK) == BLOCK_SOLID;
+
+		if (solid == TILE_INDEX_COUNT)
+		{
+			tile_t* out = buffer_get(&(tiles->buffer), TILE_SOLID);
+			out->count++;
+			return TILE_SOLID | ((temp->indices[0] & BLOCK_INVERT) ? TILE_INVERT : 0);
+		}
+	}
+
+	tile_index_t index = tiles_match(tiles, temp);
+	if (index != NO_TILE)
+	{
+        tile_t* out = buffer_get(&(tiles->buffer), index & ~TILE_BITS_MASK);
+        out->count++;
+
+		return index;
+	}
+
+	tile_t* out = buffer_alloc(&(tiles->buffer), 1);
+
+	memcpy(out->indices, temp->indices, sizeof(out->indices));
+
+	uint32_t offset = buffer_offset(&(tiles->buffer), out);
+	uint32_t hash = hash_tile(tiles, temp) & (TILES_HASH_SIZE-1);
+	out->next = tiles->hash[hash];
+	tiles->hash[hash] = offset;
+
+	out->count = 1;
+	out->remap = NO_TILE;
+
+	return offset;
+}
+
 tile_index_t tiles_insert(tiles_t* tiles, const uint8_t* pixels, uint8_t threshold, int32_t pitch)
 {
 	tile_t temp;
@@ -178,30 +251,107 @@ tile_index_t tiles_insert(tiles_t* tiles, const uint8_t* pixels, uint8_t thresho
 		}
 	}
 
-	tile_index_t index = tiles_match(tiles, &temp);
-	if (index != NO_TILE)
+	return tiles_insert_indices(tiles, &temp);
+}
+
+// drops the tiles and blocks from those counts on, for undoing what a decoder appended
+void tiles_truncate(tiles_t* tiles, size_t count, size_t blocks)
+{
+	blocks_truncate(&(tiles->blocks), blocks);
+
+	if (count >= buffer_count(&(tiles->buffer)))
+		return;
+
+	tiles->buffer.size = count * tiles->buffer.elemsize;
+
+	for (size_t i = 0; i < TILES_HASH_SIZE; ++i)
+		tiles->hash[i] = NO_TILE;
+
+	for (size_t i = 0; i < count; ++i)
 	{
-        tile_t* out = buffer_get(&(tiles->buffer), index & ~TILE_BITS_MASK);
-        out->count++;
+		tile_t* curr = buffer_get(&(tiles->buffer), i);
+		uint32_t hash = hash_tile(tiles, curr) & (TILES_HASH_SIZE-1);
+		curr->next = tiles->hash[hash];
+		tiles->hash[hash] = i;
+	}
+}
 
-		return index;
+// every tile of other is matched or appended, remaps gets where each went and the counts add up
+void tiles_merge(tiles_t* tiles, const tiles_t* other, tile_index_t* remaps)
+{
+	size_t blocks = buffer_count(&(other->blocks.buffer));
+	block_index_t* block_remaps = malloc(sizeof(block_index_t) * (blocks ? blocks : 1));
+	blocks_merge(&(tiles->blocks), &(other->blocks), block_remaps);
+
+	for (size_t i = 0, n = buffer_count(&(other->buffer)); i < n; ++i)
+	{
+		const tile_t* in = buffer_get(&(other->buffer), i);
+
+		tile_t temp;
+		for (size_t j = 0; j < TILE_INDEX_COUNT; ++j)
+			temp.indices[j] = block_remaps[in->indices[j] & ~BLOCK_BITS_MASK] ^ (in->indices[j] & BLOCK_BITS_MASK);
+
+		remaps[i] = tiles_insert_indices(tiles, &temp);
+
+		tile_t* out = buffer_get(&(tiles->buffer), remaps[i] & ~TILE_BITS_MASK);
+		out->count += in->count - 1;
 	}
 
-	tile_t* out = buffer_alloc(&(tiles->buffer), 1);
+	free(block_remaps);
+}
 
-	memcpy(out->indices, temp.indices, sizeof(out->indices));
+// appends as is without looking for a match, for tiles the decoder builds itself
+tile_index_t tiles_add(tiles_t* tiles, const tile_t* tile)
+{
+	tile_t* out = buffer_alloc(&(tiles->buffer), 1);
+	memcpy(out->indices, tile->indices, sizeof(out->indices));
 
 	uint32_t offset = buffer_offset(&(tiles->buffer), out);
-	uint32_t hash = hash_tile(tiles, &temp) & (TILES_HASH_SIZE-1);
+	uint32_t hash = hash_tile(tiles, out) & (TILES_HASH_SIZE-1);
 	out->next = tiles->hash[hash];
 	tiles->hash[hash] = offset;
 
-	out->count = 1;
+	out->count = 0;
 	out->remap = NO_TILE;
 
 	return offset;
 }
 
+tile_index_t tiles_find(const tiles_t* tiles, const tile_t* tile)
+{
+	uint32_t index = tiles->hash[hash_tile(tiles, tile) & (TILES_HASH_SIZE-1)];
+	while (index != NO_TILE)
+	{
+		const tile_t* candidate = buffer_get(&(tiles->buffer), index);
+		if (!memcmp(candidate->indices, tile->indices, sizeof(tile->indices)))
+			break;
+		index = candidate->next;
+	}
+	return index;
+}
+
+// the one block slot where the shown tile from and the stored entry to differ, -1 if it is not exactly one
+int tiles_patch_slot(const tiles_t* tiles, tile_index_t from, tile_index_t to)
+{
+	if (to & TILE_BITS_MASK)
+		return -1;
+
+	tile_t shown = tiles_get(tiles, from);
+	const tile_t* entry = buffer_get(&(tiles->buffer), to);
+
+	int slot = -1;
+	for (size_t i = 0; i < TILE_INDEX_COUNT; ++i)
+	{
+		if (shown.indices[i] == entry->indices[i])
+			continue;
+		if (slot >= 0)
+			return -1;
+		slot = i;
+	}
+
+	return slot;
+}
+
 void tiles_remap_blocks(tiles_t* tiles, const block_index_t* remaps)
 {
     for (size_t i = 0; i < TILES_HASH_SIZE; ++i)
@@ -244,7 +394,7 @@ void tiles_dedupe(tiles_t* tiles)
         uint32_t hash = hash_tile(tiles, curr) & (TILES_HASH_SIZE-1);
 
         tile_index_t index = NO_TILE;
-        for (size_t j = 0; j < sizeof_array(tile_variants); ++j)
+        for (size_t j = 0; j < tiles->variants; ++j)
         {
             uint32_t flags = tile_variants[j];
 
@@ -300,10 +450,28 @@ void tiles_dedupe(tiles_t* tiles)
     fprintf(stderr, "\n");
 }
 
+size_t tiles_diff(const tiles_t* tiles, tile_index_t a, tile_index_t b)
+{
+    tile_t ta = tiles_get(tiles, a);
+    tile_t tb = tiles_get(tiles, b);
+
+    size_t diff = 0;
+    for (size_t i = 0; i < TILE_INDEX_COUNT; ++i)
+    {
+        block_t ba = blocks_get(&(tiles->blocks), ta.indices[i]);
+        block_t bb = blocks_get(&(tiles->blocks), tb.indices[i]);
+
+        diff += block_diff(&ba, &bb);
+    }
+
+    return diff;
+}
+
 void tiles_rebuild(tiles_t* tiles, tile_index_t* remaps)
 {
     buffer_t old = tiles->buffer;
     buffer_init(&(tiles->buffer), old.elemsize);
+    buffer_reserve(&(tiles->buffer), buffer_count(&old));
 
     for (size_t i = 0; i < TILES_HASH_SIZE; ++i)
     {
@@ -313,7 +481,7 @@ void tiles_rebuild(tiles_t* tiles, tile_index_t* remaps)
     for (size_t i = 0, n = buffer_count(&old); i < n; ++i)
     {
         tile_t* old_tile = (tile_t*)buffer_get(&old, i);
-        if (old_tile->count == 0)
+        if (old_tile->count == 0 && !(tiles->blocks.solid && i == TILE_SOLID))
         {
             remaps[i] = NO_TILE;
             continue;
@@ -342,6 +510,10 @@ void tiles_rebuild(tiles_t* tiles, tile_index_t* remaps)
         if (old_tile->count > 0)
             continue;
 
+        // no longer referenced at all
+        if (old_tile->remap == NO_TILE)
+            continue;
+
         uint32_t index = old_tile->remap & ~TILE_BITS_MASK;
         uint32_t flags = old_tile->remap & TILE_BITS_MASK;
 
@@ -352,6 +524,35 @@ void tiles_rebuild(tiles_t* tiles, tile_index_t* remaps)
     buffer_release(&old);
 }
 
+// order[i] is the old index of the tile that ends up at index i
+void tiles_reorder(tiles_t* tiles, const uint32_t* order, tile_index_t* remaps)
+{
+    buffer_t old = tiles->buffer;
+    buffer_init(&(tiles->buffer), old.elemsize);
+    buffer_reserve(&(tiles->buffer), buffer_count(&old));
+
+    for (size_t i = 0; i < TILES_HASH_SIZE; ++i)
+    {
+        tiles->hash[i] = NO_TILE;
+    }
+
+    for (size_t i = 0, n = buffer_count(&old); i < n; ++i)
+    {
+        const tile_t* old_tile = (const tile_t*)buffer_get(&old, order[i]);
+        tile_t* new_tile = (tile_t*)buffer_alloc(&(tiles->buffer), 1);
+
+        *new_tile = *old_tile;
+
+        uint32_t hash = hash_tile(tiles, new_tile) & (TILES_HASH_SIZE-1);
+        new_tile->next = tiles->hash[hash];
+        tiles->hash[hash] = i;
+
+        remaps[order[i]] = i;
+    }
+
+    buffer_release(&old);
+}
+
 void tile_render(uint8_t* target, const tiles_t* tiles, const tile_t* tile, uint32_t bits, uint32_t pitch)
 {
     const block_index_t* indices = tile->indices;
@@ -361,14 +562,119 @@ void tile_render(uint8_t* target, const tiles_t* tiles, const tile_t* tile, uint
         for (size_t i = 0; i < TILE_WIDTH; i += BLOCK_HEIGHT)
         {
             block_index_t index = *(indices++);
-            block_t block = blocks_get(&(tiles->blocks), index);
             uint8_t* pixels = &target[i + j * pitch];
 
+            if (tiles->blocks.solid && (index & ~BLOCK_BITS_MASK) == BLOCK_SOLID)
+            {
+                block_fill(pixels, (index & BLOCK_INVERT) ? 255 : 0, pitch);
+                continue;
+            }
+
+            block_t block = blocks_get(&(tiles->blocks), index);
             block_render(pixels, &block, pitch);
         }
     }
 }
 
+void tile_fill(uint8_t* target, uint8_t value, uint32_t pitch)
+{
+    for (size_t y = 0; y < TILE_HEIGHT; ++y)
+        memset(&target[y * pitch], value, TILE_WIDTH);
+}
+
+void tile_fill_bits(uint8_t* target, uint8_t value, uint32_t pitch)
+{
+    for (size_t y = 0; y < TILE_HEIGHT; ++y)
+        memset(&target[y * pitch], value, TILE_WIDTH / 8);
+}
+
+/*
+    block rows to pixels by table, the lowest bit is the leftmost pixel. a flipped block reads the
+    mirrored table, an inverted one the table at the inverted row
+*/
+#define EXPAND_PIXEL(b, i) ((((b) >> (i)) & 1) * 255)
+#define EXPAND(b) { EXPAND_PIXEL(b, 0), EXPAND_PIXEL(b, 1), EXPAND_PIXEL(b, 2), EXPAND_PIXEL(b, 3), EXPAND_PIXEL(b, 4), EXPAND_PIXEL(b, 5), EXPAND_PIXEL(b, 6), EXPAND_PIXEL(b, 7) }
+#define EXPAND_MIRRORED(b) { EXPAND_PIXEL(b, 7), EXPAND_PIXEL(b, 6), EXPAND_PIXEL(b, 5), EXPAND_PIXEL(b, 4), EXPAND_PIXEL(b, 3), EXPAND_PIXEL(b, 2), EXPAND_PIXEL(b, 1), EXPAND_PIXEL(b, 0) }
+#define REVERSE(b) ((EXPAND_PIXEL(b, 0) & 0x80) | (EXPAND_PIXEL(b, 1) & 0x40) | (EXPAND_PIXEL(b, 2) & 0x20) | (EXPAND_PIXEL(b, 3) & 0x10) | (EXPAND_PIXEL(b, 4) & 0x08) | (EXPAND_PIXEL(b, 5) & 0x04) | (EXPAND_PIXEL(b, 6) & 0x02) | (EXPAND_PIXEL(b, 7) & 0x01))
+#define SAME(b) (b)
+#define ROWS4(f, b) f(b), f(b + 1), f(b + 2), f(b + 3)
+#define ROWS16(f, b) ROWS4(f, b), ROWS4(f, b + 4), ROWS4(f, b + 8), ROWS4(f, b + 12)
+#define ROWS64(f, b) ROWS16(f, b), ROWS16(f, b + 16), ROWS16(f, b + 32), ROWS16(f, b + 48)
+#define ROWS256(f) ROWS64(f, 0), ROWS64(f, 64), ROWS64(f, 128), ROWS64(f, 192)
+
+static const uint8_t expand_rows[2][256][8] = { { ROWS256(EXPAND) }, { ROWS256(EXPAND_MIRRORED) } };
+// rows for 1bpp output, leftmost pixel in the top bit, and mirrored which leaves them as they are
+static const uint8_t bit_rows[2][256] = { { ROWS256(REVERSE) }, { ROWS256(SAME) } };
+
+/*
+    the flips of the tile move onto its blocks, a flipped block reads the other table. BLOCK_FLIP_X turns
+    the block around rather than only mirroring it, so the rows run backwards for either flip but not both.
+    the dictionaries are read straight from their buffers, this runs for every tile of every frame
+*/
+#define TILE_BLOCKS_X (TILE_WIDTH / BLOCK_WIDTH)
+#define TILE_BLOCKS_Y (TILE_HEIGHT / BLOCK_HEIGHT)
+
+void tiles_render(uint8_t* target, const tiles_t* tiles, tile_index_t ti, uint32_t pitch)
+{
+    const tile_t* tile = (const tile_t*)tiles->buffer.data + (ti & ~TILE_BITS_MASK);
+    const block_t* blocks = (const block_t*)tiles->blocks.buffer.data;
+
+    for (size_t y = 0; y < TILE_BLOCKS_Y; ++y)
+    {
+        size_t sy = (ti & TILE_FLIP_Y) ? TILE_BLOCKS_Y - (y + 1) : y;
+        for (size_t x = 0; x < TILE_BLOCKS_X; ++x)
+        {
+            size_t sx = (ti & TILE_FLIP_X) ? TILE_BLOCKS_X - (x + 1) : x;
+            block_index_t index = tile->indices[sx + sy * TILE_BLOCKS_X] ^ (ti & TILE_BITS_MASK);
+
+            const uint8_t* rows = blocks[index & ~BLOCK_BITS_MASK].bits;
+            const uint8_t (*table)[8] = expand_rows[(index & BLOCK_FLIP_X) ? 1 : 0];
+            uint8_t invert = (index & BLOCK_INVERT) ? 0xff : 0;
+            size_t last = (((index & BLOCK_FLIP_X) != 0) ^ ((index & BLOCK_FLIP_Y) != 0)) ? BLOCK_HEIGHT - 1 : 0;
+
+            uint8_t* pixels = &target[x * BLOCK_WIDTH + y * BLOCK_HEIGHT * pitch];
+            for (size_t r = 0; r < BLOCK_HEIGHT; ++r)
+                memcpy(&pixels[r * pitch], table[rows[r ^ last] ^ invert], BLOCK_WIDTH);
+        }
+    }
+}
+
+// a tile row is one 16 bit word in memory, left block in the first byte, stored as one
+void tiles_render_bits(uint8_t* target, const tiles_t* tiles, tile_index_t ti, uint32_t pitch)
+{
+    const tile_t* tile = (const tile_t*)tiles->buffer.data + (ti & ~TILE_BITS_MASK);
+    const block_t* blocks = (const block_t*)tiles->blocks.buffer.data;
+
+    for (size_t y = 0; y < TILE_BLOCKS_Y; ++y)
+    {
+        size_t sy = (ti & TILE_FLIP_Y) ? TILE_BLOCKS_Y - (y + 1) : y;
+
+        const uint8_t* rows[TILE_BLOCKS_X];
+        const uint8_t* table[TILE_BLOCKS_X];
+        uint8_t invert[TILE_BLOCKS_X];
+        size_t last[TILE_BLOCKS_X];
+        for (size_t x = 0; x < TILE_BLOCKS_X; ++x)
+        {
+            size_t sx = (ti & TILE_FLIP_X) ? TILE_BLOCKS_X - (x + 1) : x;
+            block_index_t index = tile->indices[sx + sy * TILE_BLOCKS_X] ^ (ti & TILE_BITS_MASK);
+
+            rows[x] = blocks[index & ~BLOCK_BITS_MASK].bits;
+            table[x] = bit_rows[(index & BLOCK_FLIP_X) ? 1 : 0];
+            invert[x] = (index & BLOCK_INVERT) ? 0xff : 0;
+            last[x] = (((index & BLOCK_FLIP_X) != 0) ^ ((index & BLOCK_FLIP_Y) != 0)) ? BLOCK_HEIGHT - 1 : 0;
+        }
+
+        uint8_t* pixels = &target[y * BLOCK_HEIGHT * pitch];
+        for (size_t r = 0; r < BLOCK_HEIGHT; ++r)
+        {
+            uint8_t word[TILE_BLOCKS_X];
+            for (size_t x = 0; x < TILE_BLOCKS_X; ++x)
+                word[x] = table[x][rows[x][r ^ last[x]]] ^ invert[x];
+            memcpy(&pixels[r * pitch], word, sizeof(word));
+        }
+    }
+}
+
 static uint32_t bi_compress(block_index_t index, size_t bits)
 {
 	uint32_t flags = (index & BLOCK_BITS_MASK) >> (32 - bits);
@@ -390,13 +696,18 @@ static block_index_t bi_uncompress(uint32_t in, size_t bits)
 #define sizeof_member(type, member) sizeof(((type *)0)->member)
 static const size_t TILE_DATA_SIZE = sizeof_member(tile_t, indices);
 
-size_t tiles_load(const buffer_t* in, size_t offset, size_t count, tiles_t* tiles, size_t block_bits)
+long tiles_load(const buffer_t* in, size_t offset, size_t count, tiles_t* tiles, size_t block_bits)
 {
+    size_t entry = (block_bits > 16 ? sizeof(uint32_t) : sizeof(uint16_t)) * TILE_INDEX_COUNT;
+    if (offset > buffer_count(in) || (buffer_count(in) - offset) / entry < count)
+        return -1;
+
     for (size_t i = 0; i < TILES_HASH_SIZE; ++i)
     {
         tiles->hash[i] = NO_TILE;
     }
 
+    buffer_reserve(&(tiles->buffer), count);
     for (size_t i = 0, n = count; i < n; ++i)
     {
         tile_t* tile = buffer_alloc(&(tiles->buffer), 1);
@@ -423,6 +734,10 @@ size_t tiles_load(const buffer_t* in, size_t offset, size_t count, tiles_t* tile
 
                 offset += sizeof(temp);
             }
+
+            // the blocks are loaded first, a tile can only use those
+            if ((tile->indices[j] & ~BLOCK_BITS_MASK) >= buffer_count(&(tiles->blocks.buffer)))
+                return -1;
         }
 
         uint32_t hash = hash_tile(tiles, tile) & (TILES_HASH_SIZE-1);
@@ -437,9 +752,10 @@ size_t tiles_load(const buffer_t* in, size_t offset, size_t count, tiles_t* tile
     return offset;
 }
 
-void tiles_save(buffer_t* out, const tiles_t* tiles, size_t block_bits)
+void tiles_save(buffer_t* out, const tiles_t* tiles, size_t count, size_t block_bits)
 {
-	for (size_t i = 0, n = buffer_count(&(tiles->buffer)); i < n; ++i)
+	buffer_reserve(out, count * TILE_INDEX_COUNT * (block_bits > 16 ? sizeof(uint32_t) : sizeof(uint16_t)));
+	for (size_t i = 0; i < count; ++i)
 	{
 		const tile_t* tile = buffer_get(&(tiles->buffer), i);
         for (size_t j = 0; j < TILE_INDEX_COUNT; ++j)
@@ -19,6 +19,9 @@ typedef uint32_t tile_index_t;
 #define TILE_BITS_MASK (TILE_FLIP_X|TILE_FLIP_Y|TILE_INVERT)
 #define MAX_TILE_INDEX ((TILE_NO_TILE & ~TILE_BITS_MASK) - 1)
 
+// with solid blocks reserved tile 0 is four black BLOCK_SOLID blocks, TILE_SOLID|TILE_INVERT is white
+#define TILE_SOLID (0)
+
 #define TILE_INDEX_COUNT ((TILE_WIDTH / BLOCK_WIDTH) * (TILE_HEIGHT / BLOCK_HEIGHT))
 typedef struct tile_t
 {
@@ -34,20 +37,39 @@ typedef struct tiles_t
 	blocks_t blocks;
 	buffer_t buffer;
 	uint32_t hash[TILES_HASH_SIZE]; // hash table for collisions
+
+	size_t variants; // number of variants matching may use, BLOCK_VARIANTS_*
 } tiles_t;
 
 void tiles_init(tiles_t* tiles);
 void tiles_release(tiles_t* tiles);
+void tiles_reserve_solid(tiles_t* tiles);
+void tiles_reserve_slots(tiles_t* tiles, size_t count, size_t blocks);
 
 tile_t tiles_get(const tiles_t* tiles, tile_index_t ti);
+size_t tiles_diff(const tiles_t* tiles, tile_index_t a, tile_index_t b);
 
 tile_index_t tiles_insert(tiles_t* tiles, const uint8_t* pixels, uint8_t threshold, int32_t pitch);
+tile_index_t tiles_add(tiles_t* tiles, const tile_t* tile);
+// the entry with exactly the block indices of tile, no variants, NO_TILE if there is none
+tile_index_t tiles_find(const tiles_t* tiles, const tile_t* tile);
+void tiles_merge(tiles_t* tiles, const tiles_t* other, tile_index_t* remaps);
+void tiles_truncate(tiles_t* tiles, size_t count, size_t blocks);
+int tiles_patch_slot(const tiles_t* tiles, tile_index_t from, tile_index_t to);
 void tiles_remap_blocks(tiles_t* tiles, const block_index_t* remaps);
 void tiles_dedupe(tiles_t* tiles);
 void tiles_reduce(tiles_t* tiles);
 void tiles_rebuild(tiles_t* tiles, uint32_t* remaps);
+void tiles_reorder(tiles_t* tiles, const uint32_t* order, tile_index_t* remaps);
 
 void tile_render(uint8_t* target, const tiles_t* tiles, const tile_t* tile, uint32_t bits, uint32_t pitch);
+void tile_fill(uint8_t* target, uint8_t value, uint32_t pitch);
+// tile ti with its flips, expanding block rows by table without building the flipped tile or blocks
+void tiles_render(uint8_t* target, const tiles_t* tiles, tile_index_t ti, uint32_t pitch);
+// a bit per pixel, leftmost in the top bit, pitch in bytes. rows are written a word at a time, target and pitch should keep them 2 byte aligned
+void tiles_render_bits(uint8_t* target, const tiles_t* tiles, tile_index_t ti, uint32_t pitch);
+void tile_fill_bits(uint8_t* target, uint8_t value, uint32_t pitch);
 
-size_t tiles_load(const buffer_t* in, size_t offset, size_t count, tiles_t* tiles, size_t block_bits);
-void tiles_save(buffer_t* out, const tiles_t* tiles, size_t block_bits);
+long tiles_load(const buffer_t* in, size_t offset, size_t count, tiles_t* tiles, size_t block_bits);
+// only the first count tiles are written, the rest are rebuilt from frame map patches
+void tiles_save(buffer_t* out, const tiles_t* tiles, size_t count, size_t block_bits);